@@ -0,0 +1,127 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "BlockCache.hpp"
+#include "Sha256.hpp"
+
+// Segments are a sixteenth of the capacity, so eviction drops about 6%
+// of the cache at a time
+static const uint64_t SEGMENTS = 16;
+static const uint64_t MIN_SEGMENT_BYTES = 1 << 20;
+
+BlockCache::BlockCache()
+	: capacity(0)
+{
+}
+
+bool BlockCache::open(const string& t_dir, uint64_t t_capacity)
+{
+	if (mkdir(t_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+		return false;
+	}
+	dir = t_dir;
+
+	if (!index.openMapped(dir + "/cache.idx")
+		|| !log.open(dir + "/cache", max(MIN_SEGMENT_BYTES, t_capacity / SEGMENTS))) {
+		return false;
+	}
+	capacity = t_capacity;
+
+	// A smaller capacity than last run takes effect now
+	evict();
+	return compact();
+}
+
+bool BlockCache::compact()
+{
+	size_t stale = 0;
+	index.forEach([&](const BlockDigest&, const BlockLocation& location) {
+		if (!live(location)) {
+			stale++;
+		}
+	});
+	if (stale <= index.size() / 2) {
+		return true;
+	}
+
+	string path = dir + "/cache.idx";
+	string fresh = path + ".new";
+	unlink(fresh.c_str());
+	{
+		DigestTable<BlockLocation> table(index.size() - stale);
+		if (!table.openMapped(fresh)) {
+			return false;
+		}
+		bool ok = true;
+		index.forEach([&](const BlockDigest& digest, const BlockLocation& location) {
+			bool inserted;
+			if (live(location) && table.insert(digest, location, inserted) == nullptr) {
+				ok = false;
+			}
+		});
+		if (!ok || !table.sync()) {
+			return false;
+		}
+	}
+	return rename(fresh.c_str(), path.c_str()) == 0 && index.openMapped(path);
+}
+
+void BlockCache::evict()
+{
+	while (log.bytes() > capacity && log.dropOldest()) {
+	}
+}
+
+bool BlockCache::get(const BlockDigest& digest, string& block)
+{
+	BlockLocation* location = index.find(digest);
+	if (location == nullptr || !live(*location) || !log.read(*location, block)) {
+		return false;
+	}
+
+	BlockDigest check;
+	Sha256::hash(block.data(), block.size(), check.bytes);
+	if (check != digest) {
+		return false;
+	}
+
+	// Keep a block in use out of the next eviction
+	if (location->segment == log.oldest()) {
+		BlockLocation moved;
+		if (log.append(block, moved)) {
+			*location = moved;
+			evict();
+		}
+	}
+	return true;
+}
+
+bool BlockCache::put(const BlockDigest& digest, const string& block)
+{
+	BlockLocation* location = index.find(digest);
+	if (location != nullptr && live(*location)) {
+		return true;
+	}
+
+	BlockLocation stored;
+	if (!log.append(block, stored)) {
+		return false;
+	}
+	bool inserted;
+	if (location != nullptr) {
+		*location = stored;
+	} else if (index.insert(digest, stored, inserted) == nullptr) {
+		return false;
+	}
+	evict();
+	return true;
+}
+
+bool BlockCache::contains(const BlockDigest& digest) const
+{
+	const BlockLocation* location = index.find(digest);
+	return location != nullptr && live(*location);
+}
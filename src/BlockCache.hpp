@@ -0,0 +1,55 @@
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include <stdint.h>
+#include <string>
+
+#include "BlockDigest.hpp"
+#include "DigestTable.hpp"
+#include "SegmentLog.hpp"
+
+using namespace std;
+
+// Downloaded blocks kept on local disk across runs, keyed by digest. As
+// in the server's BlockStore, blocks are appended to a SegmentLog under
+// dir and indexed by a memory-mapped DigestTable.
+//
+// Once the segments hold more than capacity bytes the oldest one is
+// deleted, so the cache keeps the blocks stored or read most recently: a
+// block read from the oldest segment is appended again. Index entries
+// into a deleted segment are misses, and are dropped when open()
+// rebuilds the index. Blocks are checked against their digest when read.
+// Not thread-safe.
+class BlockCache {
+public:
+	BlockCache();
+
+	bool open(const string& t_dir, uint64_t t_capacity);
+	bool isOpen() const {
+		return capacity > 0;
+	}
+
+	bool get(const BlockDigest& digest, string& block);
+	// False on I/O failure
+	bool put(const BlockDigest& digest, const string& block);
+	bool contains(const BlockDigest& digest) const;
+
+	uint64_t bytes() const {
+		return log.bytes();
+	}
+
+protected:
+	bool live(const BlockLocation& location) const {
+		return location.segment >= log.oldest();
+	}
+	// Rewrites the index without entries into deleted segments
+	bool compact();
+	void evict();
+
+	string dir;
+	uint64_t capacity; // 0 until opened
+	DigestTable<BlockLocation> index;
+	SegmentLog log;
+};
+
+#endif // BLOCKCACHE_HPP
@@ -0,0 +1,460 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#include "BlockCodec.hpp"
+
+// LZ4 block format limits: a match is at least MINMATCH long, the last
+// LASTLITERALS bytes are always literals, and no match starts within
+// MFLIMIT bytes of the end
+static const size_t MINMATCH = 4;
+static const size_t LASTLITERALS = 5;
+static const size_t MFLIMIT = 12;
+static const size_t MAX_DISTANCE = 65535;
+
+// Chain steps the high level follows at each position
+static const int HIGH_ATTEMPTS = 64;
+
+static uint32_t read32(const unsigned char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint64_t read64(const unsigned char* p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static uint32_t hash4(uint32_t v, int bits)
+{
+	return (v * 2654435761u) >> (32 - bits);
+}
+
+static size_t matchLength(const unsigned char* a, const unsigned char* b, const unsigned char* end)
+{
+	const unsigned char* start = a;
+
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// Eight bytes at a time; the first differing byte is the lowest set
+	// one of the XOR
+	while (a + 8 <= end) {
+		uint64_t diff = read64(a) ^ read64(b);
+		if (diff != 0) {
+			return a - start + (__builtin_ctzll(diff) >> 3);
+		}
+		a += 8;
+		b += 8;
+	}
+#endif
+	while (a < end && *a == *b) {
+		++a;
+		++b;
+	}
+	return a - start;
+}
+
+static void putLength(unsigned char*& op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char) len;
+}
+
+// One sequence: literals [anchor, anchor + lits), then a match of
+// matchLen at distance offset (none when matchLen is 0, for the last).
+// Written at op, which the caller has sized for the worst case.
+static void putSequence(unsigned char*& op, const unsigned char* anchor, size_t lits, size_t offset, size_t matchLen)
+{
+	size_t ml = matchLen ? matchLen - MINMATCH : 0;
+	*op++ = (unsigned char) ((lits >= 15 ? 15 : lits) << 4 | (ml >= 15 ? 15 : ml));
+
+	if (lits >= 15) {
+		putLength(op, lits - 15);
+	}
+	memcpy(op, anchor, lits);
+	op += lits;
+	if (matchLen == 0) {
+		return;
+	}
+	*op++ = (unsigned char) (offset & 0xff);
+	*op++ = (unsigned char) (offset >> 8);
+	if (ml >= 15) {
+		putLength(op, ml - 15);
+	}
+}
+
+static int hashBits(size_t len)
+{
+	int bits = 8;
+	while (bits < 16 && ((size_t) 1 << bits) < len) {
+		++bits;
+	}
+	return bits;
+}
+
+// A hash table of positions kept by each thread across calls, so a block
+// neither allocates nor clears one. Entries hold base + position + 1;
+// those left by earlier blocks are at most base and read as empty.
+struct MatchTable {
+	vector<uint32_t> slots;
+	uint32_t base;
+
+	MatchTable() : base(0) {}
+
+	// Slots for a block of len bytes hashed to bits; sets first to the
+	// base its entries are stored against
+	uint32_t* claim(size_t len, int bits, uint32_t& first) {
+		size_t want = (size_t) 1 << bits;
+		if (slots.size() < want) {
+			slots.resize(want, 0);
+		}
+		if (base > UINT32_MAX - len - 1) {
+			fill(slots.begin(), slots.end(), 0);
+			base = 0;
+		}
+		first = base;
+		base += (uint32_t) len + 1;
+		return slots.data();
+	}
+};
+
+// Both compressors write at op and return the end of what they wrote
+static unsigned char* compressFast(const unsigned char* src, size_t len, unsigned char* op)
+{
+	static thread_local MatchTable matches;
+
+	const unsigned char* anchor = src;
+
+	if (len >= MFLIMIT + 1) {
+		int bits = hashBits(len);
+		uint32_t base;
+		uint32_t* table = matches.claim(len, bits, base);
+
+		const unsigned char* ip = src;
+		const unsigned char* limit = src + len - MFLIMIT;
+		const unsigned char* matchEnd = src + len - LASTLITERALS;
+
+		// As in LZ4, the search speeds up through data that keeps missing
+		size_t misses = 0;
+
+		while (ip < limit) {
+			uint32_t pos = (uint32_t) (ip - src);
+			uint32_t h = hash4(read32(ip), bits);
+			uint32_t candidate = table[h];
+			table[h] = base + pos + 1;
+
+			if (candidate <= base || pos - (candidate - base - 1) > MAX_DISTANCE
+				|| read32(src + candidate - base - 1) != read32(ip)) {
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			const unsigned char* ref = src + candidate - base - 1;
+			misses = 0;
+
+			// Extend backwards over literals that also match
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				--ip;
+				--ref;
+			}
+			size_t ml = MINMATCH + matchLength(ip + MINMATCH, ref + MINMATCH, matchEnd);
+
+			putSequence(op, anchor, ip - anchor, ip - ref, ml);
+			ip += ml;
+			anchor = ip;
+
+			if (ip < limit) {
+				table[hash4(read32(ip - 2), bits)] = base + (uint32_t) (ip - 2 - src) + 1;
+			}
+		}
+	}
+	putSequence(op, anchor, src + len - anchor, 0, 0);
+	return op;
+}
+
+static unsigned char* compressHigh(const unsigned char* src, size_t len, unsigned char* op)
+{
+	// Chains link each position to the previous one with its hash; a
+	// link is written before it is followed, so prev is never cleared
+	static thread_local MatchTable heads;
+	static thread_local vector<int32_t> prev;
+
+	const unsigned char* anchor = src;
+
+	if (len >= MFLIMIT + 1) {
+		int bits = hashBits(len) + 1;
+		uint32_t base;
+		uint32_t* head = heads.claim(len, bits, base);
+		if (prev.size() < len) {
+			prev.resize(len);
+		}
+
+		size_t limit = len - MFLIMIT;
+		const unsigned char* matchEnd = src + len - LASTLITERALS;
+		size_t inserted = 0;
+
+		auto insertUpTo = [&](size_t pos) {
+			for (; inserted < pos && inserted < limit; ++inserted) {
+				uint32_t h = hash4(read32(src + inserted), bits);
+				prev[inserted] = head[h] > base ? (int32_t) (head[h] - base - 1) : -1;
+				head[h] = base + (uint32_t) inserted + 1;
+			}
+		};
+
+		// Longest match for position pos among earlier positions
+		auto longest = [&](size_t pos, size_t& offset) {
+			insertUpTo(pos);
+			size_t best = 0;
+			uint32_t first = head[hash4(read32(src + pos), bits)];
+			int32_t candidate = first > base ? (int32_t) (first - base - 1) : -1;
+
+			for (int attempts = 0; candidate >= 0 && attempts < HIGH_ATTEMPTS; ++attempts) {
+				if (pos - candidate > MAX_DISTANCE) {
+					break;
+				}
+				const unsigned char* ref = src + candidate;
+				if (ref[best] == src[pos + best] && read32(ref) == read32(src + pos)) {
+					size_t ml = MINMATCH + matchLength(src + pos + MINMATCH, ref + MINMATCH, matchEnd);
+					if (ml > best) {
+						best = ml;
+						offset = pos - candidate;
+					}
+				}
+				candidate = prev[candidate];
+			}
+			return best;
+		};
+
+		size_t pos = 0;
+		while (pos < limit) {
+			size_t offset = 0;
+			size_t ml = longest(pos, offset);
+			if (ml < MINMATCH) {
+				++pos;
+				continue;
+			}
+
+			// Lazy step: take a longer match starting one byte later
+			if (pos + 1 < limit) {
+				size_t nextOffset = 0;
+				size_t next = longest(pos + 1, nextOffset);
+				if (next > ml + 1) {
+					++pos;
+					ml = next;
+					offset = nextOffset;
+				}
+			}
+
+			putSequence(op, anchor, src + pos - anchor, offset, ml);
+			pos += ml;
+			anchor = src + pos;
+		}
+	}
+	putSequence(op, anchor, src + len - anchor, 0, 0);
+	return op;
+}
+
+//-----------------------------------------------------------------
+//------------------------- Interface -----------------------------
+//-----------------------------------------------------------------
+
+bool BlockCodec::parseLevel(const string& name, Level& level)
+{
+	if (name == "none") {
+		level = NONE;
+	} else if (name == "lz4") {
+		level = FAST;
+	} else if (name == "lz4hc") {
+		level = HIGH;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+vector<string> BlockCodec::names()
+{
+	return { "raw", "lz4" };
+}
+
+double BlockCodec::sampleEntropy(const char* data, size_t len)
+{
+	static const size_t SAMPLES = 1024;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	// Evenly spaced single bytes, so a block is judged by all of its parts
+	size_t count[256] = { 0 };
+	size_t n = len < SAMPLES ? len : SAMPLES;
+	for (size_t i = 0; i < n; ++i) {
+		count[(unsigned char) data[i * len / n]]++;
+	}
+
+	double bits = 0;
+	for (size_t c : count) {
+		if (c) {
+			double p = (double) c / n;
+			bits -= p * log2(p);
+		}
+	}
+	return bits;
+}
+
+bool BlockCodec::compress(const char* data, size_t len, Level level, string& out)
+{
+	out.clear();
+	if (level == NONE || len < MFLIMIT + 1 || sampleEntropy(data, len) > MAX_ENTROPY) {
+		return false;
+	}
+
+	// Decoded length first, as a varint
+	for (size_t v = len; ; v >>= 7) {
+		if (v < 0x80) {
+			out.push_back((char) v);
+			break;
+		}
+		out.push_back((char) ((v & 0x7f) | 0x80));
+	}
+
+	// Room for the worst case, LZ4's bound, trimmed afterwards
+	size_t head = out.size();
+	out.resize(head + len + len / 255 + 16);
+
+	const unsigned char* src = (const unsigned char*) data;
+	unsigned char* start = (unsigned char*) &out[head];
+	unsigned char* end = level == HIGH ? compressHigh(src, len, start) : compressFast(src, len, start);
+	out.resize(head + (end - start));
+
+	if (out.size() > len - len / 16) {
+		out.clear();
+		return false;
+	}
+	return true;
+}
+
+bool BlockCodec::decompress(int codec, const char* data, size_t len, string& block)
+{
+	if (codec == CODEC_RAW) {
+		block.assign(data, len);
+		return true;
+	}
+	if (codec != CODEC_LZ4) {
+		return false;
+	}
+
+	const unsigned char* ip = (const unsigned char*) data;
+	const unsigned char* end = ip + len;
+
+	uint64_t raw = 0;
+	for (int shift = 0; ; shift += 7) {
+		if (ip == end || shift > 35) {
+			return false;
+		}
+		unsigned char b = *ip++;
+		raw |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			break;
+		}
+	}
+
+	// LZ4 cannot expand data more than 255 times, so a larger claim is bogus
+	if (raw > (uint64_t) len * 255) {
+		return false;
+	}
+	block.resize(raw);
+	char* out = &block[0];
+	size_t op = 0;
+
+	while (true) {
+		if (ip == end) {
+			return false;
+		}
+		unsigned char token = *ip++;
+
+		size_t lits = token >> 4;
+		if (lits == 15) {
+			unsigned char b;
+			do {
+				if (ip == end) {
+					return false;
+				}
+				b = *ip++;
+				lits += b;
+			} while (b == 255);
+		}
+		if (lits > (size_t) (end - ip) || lits > raw - op) {
+			return false;
+		}
+		memcpy(out + op, ip, lits);
+		ip += lits;
+		op += lits;
+
+		// The last sequence has literals only
+		if (ip == end) {
+			return op == raw;
+		}
+
+		if (end - ip < 2) {
+			return false;
+		}
+		size_t offset = ip[0] | (size_t) ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op) {
+			return false;
+		}
+
+		size_t ml = token & 15;
+		if (ml == 15) {
+			unsigned char b;
+			do {
+				if (ip == end) {
+					return false;
+				}
+				b = *ip++;
+				ml += b;
+			} while (b == 255);
+		}
+		ml += MINMATCH;
+		if (ml > raw - op) {
+			return false;
+		}
+
+		// Byte by byte only when the match overlaps what it is copying
+		const char* ref = out + op - offset;
+		if (offset >= ml) {
+			memcpy(out + op, ref, ml);
+		} else {
+			for (size_t i = 0; i < ml; ++i) {
+				out[op + i] = ref[i];
+			}
+		}
+		op += ml;
+	}
+}
+
+bool BlockCodec::untag(const string& coded, int& codec, const char*& payload, size_t& len)
+{
+	if (coded.empty()) {
+		return false;
+	}
+	codec = (unsigned char) coded[0];
+	payload = coded.data() + 1;
+	len = coded.size() - 1;
+	return codec == CODEC_RAW || codec == CODEC_LZ4;
+}
+
+bool BlockCodec::decode(const string& coded, string& block)
+{
+	int codec;
+	const char* payload;
+	size_t len;
+	return untag(coded, codec, payload, len) && decompress(codec, payload, len, block);
+}
@@ -0,0 +1,56 @@
+#ifndef BLOCKCODEC_HPP
+#define BLOCKCODEC_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Per-block compression. Compressed blocks use the LZ4 block format
+// behind a varint of their decoded length, and travel and are stored
+// with a codec tag so raw and compressed blocks can be told apart.
+//
+// A coded block on the wire (store_coded_blocks, get_coded_blocks) is
+// the codec byte followed by the payload: the block itself for
+// CODEC_RAW, or the compressed form for CODEC_LZ4.
+class BlockCodec {
+public:
+	enum Codec {
+		CODEC_RAW = 0,
+		CODEC_LZ4 = 1
+	};
+
+	enum Level {
+		NONE,  // never compress
+		FAST,  // lz4: one hash probe per position
+		HIGH   // lz4hc: searches hash chains for the longest match
+	};
+
+	static bool parseLevel(const string& name, Level& level);
+
+	// Names of the codecs this build can decode, as reported by get_codecs
+	static vector<string> names();
+
+	// Compresses len bytes at data into out (payload only, no tag).
+	// False, leaving out empty, when the block looks incompressible or
+	// compression would not save at least 1/16 of it: send it raw.
+	// Each thread reuses its own match tables from block to block.
+	static bool compress(const char* data, size_t len, Level level, string& out);
+
+	// Decodes a payload of the given codec into block; false if it is
+	// malformed or the codec is unknown
+	static bool decompress(int codec, const char* data, size_t len, string& block);
+
+	// Splits a coded block into its codec and payload
+	static bool untag(const string& coded, int& codec, const char*& payload, size_t& len);
+	static bool decode(const string& coded, string& block);
+
+	// Order-0 entropy of a sample of the block, in bits per byte, above
+	// which compression is not tried
+	static constexpr double MAX_ENTROPY = 7.2;
+	static double sampleEntropy(const char* data, size_t len);
+};
+
+#endif // BLOCKCODEC_HPP
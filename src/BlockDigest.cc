@@ -0,0 +1,43 @@
+#include "BlockDigest.hpp"
+
+static int hexValue(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+bool BlockDigest::fromHex(const string& hex, BlockDigest& digest)
+{
+	if (hex.size() != 2 * SIZE) {
+		return false;
+	}
+	for (size_t i = 0; i < SIZE; ++i) {
+		int hi = hexValue(hex[2 * i]);
+		int lo = hexValue(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0) {
+			return false;
+		}
+		digest.bytes[i] = (uint8_t) ((hi << 4) | lo);
+	}
+	return true;
+}
+
+string BlockDigest::toHex() const
+{
+	static const char digits[] = "0123456789abcdef";
+	string hex(2 * SIZE, '0');
+
+	for (size_t i = 0; i < SIZE; ++i) {
+		hex[2 * i] = digits[bytes[i] >> 4];
+		hex[2 * i + 1] = digits[bytes[i] & 0xf];
+	}
+	return hex;
+}
@@ -0,0 +1,43 @@
+#ifndef BLOCKDIGEST_HPP
+#define BLOCKDIGEST_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+// Raw 32-byte SHA-256 digest of a block. Clients keep exchanging the
+// 64-character hex form over RPC; stores and indexes key on this.
+struct BlockDigest {
+	static const size_t SIZE = 32;
+
+	uint8_t bytes[SIZE];
+
+	// Parses a 64-character hex string; false if it is malformed
+	static bool fromHex(const string& hex, BlockDigest& digest);
+	string toHex() const;
+
+	// SHA-256 output is uniform, so any 8 bytes make a good hash. Tables
+	// index on word 0; stores pick shards with word 1 so the two stay
+	// independent.
+	uint64_t word(int n) const {
+		uint64_t w;
+		memcpy(&w, bytes + 8 * n, sizeof(w));
+		return w;
+	}
+
+	// The all-zero digest marks an empty slot in a DigestTable
+	bool empty() const {
+		return (word(0) | word(1) | word(2) | word(3)) == 0;
+	}
+
+	bool operator==(const BlockDigest& other) const {
+		return memcmp(bytes, other.bytes, SIZE) == 0;
+	}
+	bool operator!=(const BlockDigest& other) const {
+		return !(*this == other);
+	}
+};
+
+#endif // BLOCKDIGEST_HPP
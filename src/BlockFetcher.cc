@@ -0,0 +1,351 @@
+#include <algorithm>
+
+#include "BlockFetcher.hpp"
+#include "BlockCodec.hpp"
+#include "Sha256.hpp"
+#include "logger.hpp"
+
+#include "rpc/rpc_error.h"
+
+// Hedging waits for this many calls to be timed, and meanwhile hedges a
+// call that takes DEFAULT_HEDGE_RATIO times what was expected
+static const size_t MIN_SAMPLES = 8;
+static const double DEFAULT_HEDGE_RATIO = 3.0;
+static const size_t MAX_SAMPLES = 128;
+
+// No call is hedged sooner than this, so fast links do not duplicate
+// every call over scheduling noise
+static const double MIN_HEDGE_MS = 2.0;
+
+// rpclib has no completion callbacks and futures cannot be waited on
+// together, so an idle step waits on one reply for at most this long
+// before looking at the others
+static const chrono::microseconds POLL(250);
+
+BlockFetcher::BlockFetcher(const vector<rpc::client*>& t_clients, const vector<bool>& t_coded, LinkEstimator& t_links,
+                           size_t t_batchBytes, double t_hedgePercentile, uint64_t t_timeoutMs)
+	: clients(t_clients), coded(t_coded), links(t_links), loads(t_clients.size()), batchBytes(t_batchBytes),
+	  hedgePercentile(t_hedgePercentile), timeoutMs(t_timeoutMs), nextJob(0), jobBytes(0),
+	  nextRatio(0), hedges(0)
+{
+	for (auto& load : loads) {
+		load.queued = 0;
+		load.received = 0;
+	}
+}
+
+uint64_t BlockFetcher::received(int server) const
+{
+	return loads[server].received;
+}
+
+size_t BlockFetcher::hedged() const
+{
+	return hedges;
+}
+
+//-----------------------------------------------------------------
+//------------------------- Estimates -----------------------------
+//-----------------------------------------------------------------
+
+double BlockFetcher::cost(int server, size_t bytes) const
+{
+	return links.expected(server, loads[server].queued + bytes);
+}
+
+double BlockFetcher::hedgeRatio() const
+{
+	if (ratios.size() < MIN_SAMPLES) {
+		return DEFAULT_HEDGE_RATIO;
+	}
+	vector<double> sorted(ratios);
+	size_t at = (size_t) ((sorted.size() - 1) * hedgePercentile / 100);
+	nth_element(sorted.begin(), sorted.begin() + at, sorted.end());
+	return max(1.0, sorted[at]);
+}
+
+chrono::steady_clock::time_point BlockFetcher::nextDue(double ratio) const
+{
+	auto due = chrono::steady_clock::time_point::max();
+
+	for (auto& request : requests) {
+		double ms = timeoutMs;
+		if (!request.hedged && hedgePercentile > 0) {
+			ms = min(ms, max(MIN_HEDGE_MS, request.expected * ratio));
+		}
+		auto at = request.issued + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, milli>(ms));
+		due = min(due, at);
+	}
+	return due;
+}
+
+void BlockFetcher::measure(Request& request, size_t bytes, double ms)
+{
+	if (request.expected > 0) {
+		if (ratios.size() < MAX_SAMPLES) {
+			ratios.push_back(ms / request.expected);
+		} else {
+			ratios[nextRatio] = ms / request.expected;
+		}
+		nextRatio = (nextRatio + 1) % MAX_SAMPLES;
+	}
+
+	loads[request.server].received += bytes;
+	links.finished(request.server, request.issued, bytes);
+}
+
+//-----------------------------------------------------------------
+//-------------------------- Fetching -----------------------------
+//-----------------------------------------------------------------
+
+size_t BlockFetcher::Entry::live() const
+{
+	size_t n = 0;
+	for (auto& entry : asking) {
+		auto stale = late.find(entry.first);
+		if (stale == late.end() || stale->second < entry.second) {
+			n++;
+		}
+	}
+	return n;
+}
+
+bool BlockFetcher::choose(Entry& entry, int& piece, int& server)
+{
+	const FetchJob& job = entry.job;
+	double best = 0;
+	size_t bestAt = 0;
+	piece = -1;
+
+	for (size_t p = 0; p < job.pieces.size(); p++) {
+		if (job.got.count(p)) {
+			continue;
+		}
+		// A piece only asked of late calls may be asked again
+		auto asked = entry.asking.find(p);
+		if (asked != entry.asking.end() && entry.late[p] < asked->second) {
+			continue;
+		}
+		const vector<int>& untried = entry.untried[p];
+		for (size_t h = 0; h < untried.size(); h++) {
+			double c = cost(untried[h], job.bytes);
+			if (piece < 0 || c < best) {
+				best = c;
+				piece = (int) p;
+				bestAt = h;
+			}
+		}
+	}
+	if (piece < 0) {
+		return false;
+	}
+	vector<int>& untried = entry.untried[piece];
+	server = untried[bestAt];
+	untried.erase(untried.begin() + bestAt);
+	return true;
+}
+
+void BlockFetcher::issue(map<int, vector<Ask>>& serverAsks)
+{
+	for (auto& entry : serverAsks) {
+		const vector<Ask>& asks = entry.second;
+
+		for (size_t first = 0; first < asks.size(); ) {
+			Request request;
+			request.server = entry.first;
+			request.bytes = 0;
+
+			vector<string> batch;
+			size_t last = first;
+			while (last < asks.size() && (last == first || request.bytes < batchBytes)) {
+				const FetchJob& job = jobs[asks[last].job].job;
+				batch.push_back(job.pieces[asks[last].piece].hash);
+				request.asks.push_back(asks[last]);
+				request.bytes += job.bytes;
+				last++;
+			}
+			first = last;
+
+			loads[entry.first].queued += request.bytes;
+			request.expected = cost(entry.first, 0);
+			request.issued = chrono::steady_clock::now();
+			request.reply = clients[entry.first]->async_call(coded[entry.first] ? "get_coded_blocks" : "get_blocks", batch);
+			request.hedged = false;
+			requests.push_back(std::move(request));
+		}
+	}
+	serverAsks.clear();
+}
+
+void BlockFetcher::submit(FetchJob job)
+{
+	uint64_t id = nextJob++;
+	Entry& entry = jobs[id];
+
+	for (auto& piece : job.pieces) {
+		entry.untried.push_back(piece.holders);
+	}
+	jobBytes += job.need * job.bytes;
+	entry.job = std::move(job);
+	changed.insert(id);
+}
+
+void BlockFetcher::finish(uint64_t id, vector<FetchJob>& done)
+{
+	auto found = jobs.find(id);
+	jobBytes -= found->second.job.need * found->second.job.bytes;
+	done.push_back(std::move(found->second.job));
+	jobs.erase(found);
+}
+
+bool BlockFetcher::complete(Request& request, double ratio, vector<FetchJob>& done)
+{
+	auto log = logger();
+
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - request.issued).count();
+	bool timedOut = false;
+
+	if (request.reply.wait_for(chrono::seconds(0)) != future_status::ready) {
+		if (ms <= timeoutMs) {
+			// A late call is hedged by no longer counting what it owes, so
+			// the next step asks for it elsewhere
+			if (!request.hedged && hedgePercentile > 0 && ms > max(MIN_HEDGE_MS, request.expected * ratio)) {
+				request.hedged = true;
+				bool owes = false;
+				for (auto& ask : request.asks) {
+					auto found = jobs.find(ask.job);
+					if (found != jobs.end()) {
+						found->second.late[ask.piece]++;
+						changed.insert(ask.job);
+						owes = true;
+					}
+				}
+				if (owes) {
+					hedges++;
+				}
+			}
+			return false;
+		}
+		log->error("Block request to server {} timed out", request.server);
+		timedOut = true;
+	}
+
+	Load& load = loads[request.server];
+	load.queued -= min(request.bytes, load.queued);
+
+	for (auto& ask : request.asks) {
+		auto found = jobs.find(ask.job);
+		if (found == jobs.end()) {
+			continue;
+		}
+		Entry& entry = found->second;
+		changed.insert(ask.job);
+		if (--entry.asking[ask.piece] == 0) {
+			entry.asking.erase(ask.piece);
+		}
+		if (request.hedged && --entry.late[ask.piece] == 0) {
+			entry.late.erase(ask.piece);
+		}
+	}
+
+	if (timedOut) {
+		return true;
+	}
+
+	vector<string> reply;
+	try {
+		reply = request.reply.get().as<vector<string>>();
+	} catch (std::exception& e) {
+		log->error("Block request to server {} failed: {}", request.server, e.what());
+		return true;
+	}
+
+	size_t got = 0;
+	for (size_t a = 0; a < reply.size() && a < request.asks.size(); a++) {
+		got += reply[a].size();
+
+		auto found = jobs.find(request.asks[a].job);
+		if (found == jobs.end() || reply[a].empty()) {
+			continue;
+		}
+		FetchJob& job = found->second.job;
+		int piece = request.asks[a].piece;
+		if (job.got.count(piece)) {
+			continue;
+		}
+		string bytes;
+		if (!coded[request.server]) {
+			bytes.swap(reply[a]);
+		} else if (!BlockCodec::decode(reply[a], bytes)) {
+			log->error("Block {} from server {} does not decode", job.pieces[piece].hash, request.server);
+			continue;
+		}
+		if (job.verify && Sha256::hashHex(bytes.data(), bytes.size()) != job.pieces[piece].hash) {
+			log->error("Block {} from server {} does not match its hash", job.pieces[piece].hash, request.server);
+			continue;
+		}
+		job.got[piece].swap(bytes);
+		if (job.got.size() == job.need) {
+			finish(found->first, done);
+		}
+	}
+	measure(request, got, ms);
+	return true;
+}
+
+void BlockFetcher::step(vector<FetchJob>& done)
+{
+	size_t finished = done.size();
+
+	// Top each job whose calls changed up to need + spare pieces asked
+	// of calls that are not late; one that nobody is left to ask is done
+	map<int, vector<Ask>> serverAsks;
+
+	for (uint64_t id : changed) {
+		auto found = jobs.find(id);
+		if (found == jobs.end()) {
+			continue;
+		}
+		Entry& entry = found->second;
+		FetchJob& job = entry.job;
+		int piece, server;
+
+		while (job.got.size() + entry.live() < job.need + job.spare && choose(entry, piece, server)) {
+			serverAsks[server].push_back(Ask{id, piece});
+			entry.asking[piece]++;
+		}
+		if (entry.asking.empty()) {
+			finish(id, done);
+		}
+	}
+	changed.clear();
+	issue(serverAsks);
+
+	// Take replies as they come; calls whose jobs are all done are still
+	// waited for, so their bytes keep counting against their server
+	double ratio = hedgeRatio();
+
+	for (size_t r = 0; r < requests.size(); ) {
+		if (complete(requests[r], ratio, done)) {
+			requests.erase(requests.begin() + r);
+		} else {
+			r++;
+		}
+	}
+
+	// Nothing finished and nothing to ask for: wait on the call expected
+	// to answer first, until it does, a call falls due or the slice ends
+	if (done.size() == finished && changed.empty() && !requests.empty()) {
+		auto finishes = [](const Request& request) {
+			return request.issued + chrono::duration_cast<chrono::steady_clock::duration>(
+				chrono::duration<double, milli>(request.expected));
+		};
+		Request* first = &requests.front();
+		for (auto& request : requests) {
+			if (finishes(request) < finishes(*first)) {
+				first = &request;
+			}
+		}
+		first->reply.wait_until(min(nextDue(ratio), chrono::steady_clock::now() + POLL));
+	}
+}
@@ -0,0 +1,157 @@
+#ifndef BLOCKFETCHER_HPP
+#define BLOCKFETCHER_HPP
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "rpc/client.h"
+
+#include "LinkEstimator.hpp"
+
+using namespace std;
+
+// A block, or one fragment of it, and the servers that may hold it
+struct FetchPiece {
+	string hash;
+	vector<int> holders;
+};
+
+// One block to download, rebuilt from need distinct pieces: a replicated
+// block is a single piece held by several servers, an erasure-coded one
+// is k + m fragments of which any k will do. spare more pieces are asked
+// for up front; bytes is the expected size of a piece. tag is the
+// caller's, handed back with the job.
+struct FetchJob {
+	vector<FetchPiece> pieces;
+	size_t need;
+	size_t spare;
+	size_t bytes;
+	bool verify; // pieces are named by the SHA-256 of their bytes, checked on arrival
+	uint64_t tag;
+
+	map<int, string> got; // piece number -> its bytes, decoded
+};
+
+// Fetches the pieces of the blocks submitted from every server holding
+// them at once, in get_blocks (or get_coded_blocks) calls of at most
+// batchBytes. Each piece goes to the holder expected to return it
+// soonest, given the round trip and bandwidth links estimates for that
+// server and the bytes already asked of it, so blocks are spread over all replicas in
+// proportion to how fast they are. Jobs finish in whatever order their
+// pieces arrive.
+//
+// A call still outstanding after hedgePercentile of calls would have
+// finished, relative to what was expected of them, is hedged: what it
+// still owes is asked of other holders as well and the first answer is
+// kept. A late call keeps weighing on its server until it answers, so a
+// stalled server is avoided. Pieces that come back empty, as after a
+// Bloom filter false positive, or that do not match their hash, are
+// asked of the next holder.
+class BlockFetcher {
+public:
+	BlockFetcher(const vector<rpc::client*>& t_clients, const vector<bool>& t_coded, LinkEstimator& t_links,
+	             size_t t_batchBytes, double t_hedgePercentile, uint64_t t_timeoutMs);
+
+	void submit(FetchJob job);
+
+	// Asks for what submitted jobs still need and takes the replies that
+	// arrived. If that finishes nothing, waits on the reply expected
+	// first, for at most a short slice or until a call falls due for
+	// hedging. Jobs that have need pieces, or that no holder is left to
+	// ask, are moved into done.
+	void step(vector<FetchJob>& done);
+
+	// Jobs submitted and not done yet, and the bytes they expect
+	size_t queued() const {
+		return jobs.size();
+	}
+	size_t queuedBytes() const {
+		return jobBytes;
+	}
+
+	// Bytes received from a server, and calls hedged so far
+	uint64_t received(int server) const;
+	size_t hedged() const;
+
+protected:
+	struct Load {
+		size_t queued; // bytes asked of it and not answered yet
+		uint64_t received;
+	};
+
+	struct Ask {
+		uint64_t job;
+		int piece;
+	};
+
+	struct Request {
+		int server;
+		vector<Ask> asks;
+		size_t bytes;    // expected
+		double expected; // milliseconds
+		chrono::steady_clock::time_point issued;
+		future<RPCLIB_MSGPACK::object_handle> reply;
+		bool hedged;
+	};
+
+	// A submitted job and its bookkeeping
+	struct Entry {
+		FetchJob job;
+		vector<vector<int>> untried; // holders of each piece not asked yet
+		map<int, int> asking;        // piece -> calls asking for it
+		map<int, int> late;          // piece -> those of them hedged
+
+		// Pieces asked of at least one call that is not late
+		size_t live() const;
+	};
+
+	// Milliseconds until server returns bytes more than already queued
+	double cost(int server, size_t bytes) const;
+
+	// Picks the piece of a job, among those not got or asked of a call
+	// that is not late, and the holder not asked yet that should return
+	// it soonest; false if there is none
+	bool choose(Entry& entry, int& piece, int& server);
+
+	// Sends the asks given in calls of at most batchBytes per server
+	void issue(map<int, vector<Ask>>& serverAsks);
+
+	// Takes a reply, or hedges the call if it runs late; false while it
+	// is outstanding
+	bool complete(Request& request, double ratio, vector<FetchJob>& done);
+
+	void finish(uint64_t id, vector<FetchJob>& done);
+
+	// How many times its expected time a call may take before it is hedged
+	double hedgeRatio() const;
+
+	// When the first outstanding call falls due to be hedged or times out
+	chrono::steady_clock::time_point nextDue(double ratio) const;
+
+	void measure(Request& request, size_t bytes, double ms);
+
+	vector<rpc::client*> clients;
+	vector<bool> coded;
+	LinkEstimator& links;
+	vector<Load> loads;
+	size_t batchBytes;
+	double hedgePercentile; // 0: never hedge
+	uint64_t timeoutMs;
+
+	map<uint64_t, Entry> jobs;
+	set<uint64_t> changed; // jobs submitted or with calls answered or late since the last step
+	uint64_t nextJob;
+	size_t jobBytes;
+	vector<Request> requests; // outstanding
+
+	vector<double> ratios; // elapsed / expected of recent calls
+	size_t nextRatio;
+	size_t hedges;
+};
+
+#endif // BLOCKFETCHER_HPP
@@ -0,0 +1,223 @@
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "BlockStore.hpp"
+
+BlockStore::BlockStore(size_t t_numshards)
+	: numshards(t_numshards > 0 ? t_numshards : 1),
+	  shards(new Shard[t_numshards > 0 ? t_numshards : 1]),
+	  persistent(false)
+{
+}
+
+// mkdir -p
+static bool makeDirs(const string& dir)
+{
+	for (size_t idx = 1; idx <= dir.size(); ++idx) {
+		if (idx < dir.size() && dir[idx] != '/') {
+			continue;
+		}
+		string sub = dir.substr(0, idx);
+		if (mkdir(sub.c_str(), 0755) < 0 && errno != EEXIST) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BlockStore::open(const string& dir, uint64_t segmentBytes)
+{
+	if (!makeDirs(dir)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < numshards; ++i) {
+		char name[32];
+		snprintf(name, sizeof(name), "/shard-%03zu", i);
+		string prefix = dir + name;
+
+		lock_guard<mutex> guard(shards[i].lock);
+		if (!shards[i].index.openMapped(prefix + ".idx")
+			|| !shards[i].log.open(prefix, segmentBytes)
+			|| !repairIndex(shards[i], prefix + ".idx")) {
+			return false;
+		}
+		shards[i].blocks.clear();
+	}
+	persistent = true;
+	return true;
+}
+
+bool BlockStore::repairIndex(Shard& shard, const string& path)
+{
+	// Index slots are published through the mapping as soon as a block is
+	// appended, without waiting for the segment write to reach disk, so
+	// after a crash an entry can point past the end of its segment. The
+	// header count can also lag the slots.
+	size_t held = 0, total = 0;
+	shard.index.forEach([&](const BlockDigest&, const BlockLocation& location) {
+		total++;
+		if (shard.log.holds(location)) {
+			held++;
+		}
+	});
+	if (held == total && total == shard.index.size()) {
+		return true;
+	}
+
+	// Rebuilt beside the index and renamed over it, as DigestTable grows
+	string fresh = path + ".new";
+	::remove(fresh.c_str());
+	{
+		DigestTable<BlockLocation> table(held);
+		if (!table.openMapped(fresh)) {
+			return false;
+		}
+		bool ok = true;
+		shard.index.forEach([&](const BlockDigest& digest, const BlockLocation& location) {
+			bool inserted;
+			if (shard.log.holds(location) && table.insert(digest, location, inserted) == nullptr) {
+				ok = false;
+			}
+		});
+		if (!ok || !table.sync()) {
+			return false;
+		}
+	}
+	return ::rename(fresh.c_str(), path.c_str()) == 0 && shard.index.openMapped(path);
+}
+
+const BlockStore::Shard& BlockStore::shardFor(const BlockDigest& digest) const
+{
+	return shards[digest.word(1) % numshards];
+}
+
+BlockStore::Shard& BlockStore::shardFor(const BlockDigest& digest)
+{
+	return shards[digest.word(1) % numshards];
+}
+
+bool BlockStore::getStored(const BlockDigest& digest, string& data, int& codec) const
+{
+	const Shard& shard = shardFor(digest);
+	lock_guard<mutex> guard(shard.lock);
+
+	const BlockLocation* location = shard.index.find(digest);
+	if (location == nullptr) {
+		return false;
+	}
+	codec = location->codec();
+	if (persistent) {
+		return shard.log.read(*location, data);
+	}
+	data = shard.blocks[location->offset()];
+	return true;
+}
+
+bool BlockStore::get(const BlockDigest& digest, string& block) const
+{
+	int codec;
+	if (!getStored(digest, block, codec)) {
+		return false;
+	}
+	if (codec == BlockCodec::CODEC_RAW) {
+		return true;
+	}
+	// Decompressed outside the shard lock
+	string payload;
+	payload.swap(block);
+	if (!BlockCodec::decompress(codec, payload.data(), payload.size(), block)) {
+		block.clear();
+		return false;
+	}
+	return true;
+}
+
+bool BlockStore::getCoded(const BlockDigest& digest, string& coded) const
+{
+	int codec;
+	string data;
+	if (!getStored(digest, data, codec)) {
+		return false;
+	}
+	coded.reserve(data.size() + 1);
+	coded.assign(1, (char) codec);
+	coded += data;
+	return true;
+}
+
+bool BlockStore::put(const BlockDigest& digest, const string& block, int codec)
+{
+	Shard& shard = shardFor(digest);
+	lock_guard<mutex> guard(shard.lock);
+
+	// Blocks are content addressed, so a known digest is already stored
+	if (shard.index.find(digest) != nullptr) {
+		return true;
+	}
+
+	BlockLocation location;
+	if (persistent) {
+		if (!shard.log.append(block, location)) {
+			return false;
+		}
+	} else {
+		location.segment = 0;
+		location.length = block.size();
+		location.place = 0;
+		location.setOffset(shard.blocks.size());
+	}
+	location.setCodec(codec);
+
+	bool inserted;
+	if (shard.index.insert(digest, location, inserted) == nullptr) {
+		return false;
+	}
+	if (!persistent) {
+		shard.blocks.push_back(block);
+	}
+	return true;
+}
+
+bool BlockStore::contains(const BlockDigest& digest) const
+{
+	const Shard& shard = shardFor(digest);
+	lock_guard<mutex> guard(shard.lock);
+
+	return shard.index.find(digest) != nullptr;
+}
+
+list<string> BlockStore::hashes() const
+{
+	list<string> ret;
+
+	for (size_t i = 0; i < numshards; ++i) {
+		lock_guard<mutex> guard(shards[i].lock);
+		shards[i].index.forEach([&](const BlockDigest& digest, const BlockLocation&) {
+			ret.push_back(digest.toHex());
+		});
+	}
+	return ret;
+}
+
+void BlockStore::forEach(const function<void(const BlockDigest&)>& func) const
+{
+	for (size_t i = 0; i < numshards; ++i) {
+		lock_guard<mutex> guard(shards[i].lock);
+		shards[i].index.forEach([&](const BlockDigest& digest, const BlockLocation&) {
+			func(digest);
+		});
+	}
+}
+
+size_t BlockStore::size() const
+{
+	size_t ret = 0;
+
+	for (size_t i = 0; i < numshards; ++i) {
+		lock_guard<mutex> guard(shards[i].lock);
+		ret += shards[i].index.size();
+	}
+	return ret;
+}
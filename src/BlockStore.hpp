@@ -0,0 +1,81 @@
+#ifndef BLOCKSTORE_HPP
+#define BLOCKSTORE_HPP
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BlockCodec.hpp"
+#include "BlockDigest.hpp"
+#include "DigestTable.hpp"
+#include "SegmentLog.hpp"
+
+using namespace std;
+
+// Thread-safe digest -> block store. Blocks are spread over a fixed number
+// of shards, each guarded by its own mutex, so RPC worker threads only
+// contend when they touch the same shard. Within a shard a DigestTable
+// maps the raw digest to the block's location.
+//
+// By default blocks are kept in memory. After open() each shard appends
+// blocks to its own SegmentLog and keeps its index in a memory-mapped
+// file, so the store survives restarts and is bounded by disk, not RAM.
+// Index entries are checked against the segments on open(), so one left
+// pointing at bytes lost in a crash is dropped rather than served.
+class BlockStore {
+public:
+	explicit BlockStore(size_t t_numshards = DEFAULT_SHARDS);
+
+	// Switches an empty store to the on-disk layout under dir, loading any
+	// blocks a previous run left there. The shard count must not change
+	// between runs over the same directory.
+	bool open(const string& dir, uint64_t segmentBytes = DEFAULT_SEGMENT_BYTES);
+
+	// Copies the block for digest into block, decompressing it if it was
+	// stored compressed; false, leaving block empty, if it is not stored
+	// or does not decode
+	bool get(const BlockDigest& digest, string& block) const;
+	// The block as stored: its codec byte followed by the payload
+	bool getCoded(const BlockDigest& digest, string& coded) const;
+	// Stores data, a block encoded with codec, unless digest is already
+	// present; false on I/O failure
+	bool put(const BlockDigest& digest, const string& data, int codec = BlockCodec::CODEC_RAW);
+	bool contains(const BlockDigest& digest) const;
+
+	// Snapshot of every stored hash, hex encoded
+	list<string> hashes() const;
+	// Calls func for every stored digest, one shard lock at a time
+	void forEach(const function<void(const BlockDigest&)>& func) const;
+	size_t size() const;
+
+	static const size_t DEFAULT_SHARDS = 64;
+	static const uint64_t DEFAULT_SEGMENT_BYTES = 256ULL << 20;
+
+protected:
+	struct Shard {
+		mutable mutex lock;
+		DigestTable<BlockLocation> index;
+		vector<string> blocks; // in-memory mode; location.offset indexes it
+		SegmentLog log;        // on-disk mode
+		char pad[64]; // keep neighbouring shard locks off one cache line
+	};
+
+	// Drops index entries whose bytes did not reach the shard's segments
+	// before a crash, rewriting the index file at path
+	bool repairIndex(Shard& shard, const string& path);
+
+	// Stored bytes and codec of digest
+	bool getStored(const BlockDigest& digest, string& data, int& codec) const;
+
+	const Shard& shardFor(const BlockDigest& digest) const;
+	Shard& shardFor(const BlockDigest& digest);
+
+	size_t numshards;
+	unique_ptr<Shard[]> shards;
+	bool persistent;
+};
+
+#endif // BLOCKSTORE_HPP
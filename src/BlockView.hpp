@@ -0,0 +1,41 @@
+#ifndef BLOCKVIEW_HPP
+#define BLOCKVIEW_HPP
+
+#include <memory>
+#include <string>
+
+#include "MappedFile.hpp"
+
+using namespace std;
+
+// A block's bytes inside a mapped file. Copies share the mapping, which
+// stays mapped while any view of it is alive, so a view can sit in an
+// upload batch after its file has been closed by the reader. A default
+// view is empty and belongs to no file.
+struct BlockView {
+	shared_ptr<const MappedFile> file;
+	size_t offset;
+	size_t length;
+
+	BlockView()
+		: offset(0), length(0)
+	{
+	}
+
+	BlockView(const shared_ptr<const MappedFile>& t_file, size_t t_offset, size_t t_length)
+		: file(t_file), offset(t_offset), length(t_length)
+	{
+	}
+
+	const char* data() const {
+		return file ? file->data() + offset : nullptr;
+	}
+	size_t size() const {
+		return length;
+	}
+	string str() const {
+		return string(data(), length);
+	}
+};
+
+#endif // BLOCKVIEW_HPP
@@ -0,0 +1,79 @@
+#include <math.h>
+
+#include "BloomFilter.hpp"
+
+BloomFilter::BloomFilter(size_t t_nbits, int t_hashes)
+	: nbits(64), numhashes(t_hashes > 0 ? t_hashes : 1)
+{
+	while (nbits < t_nbits) {
+		nbits <<= 1;
+	}
+	words.reset(new atomic<uint64_t>[nbits / 64]);
+	for (size_t i = 0; i < nbits / 64; ++i) {
+		words[i].store(0, memory_order_relaxed);
+	}
+}
+
+void BloomFilter::add(const BlockDigest& digest)
+{
+	for (int i = 0; i < numhashes; ++i) {
+		uint64_t bit = probe(digest, i) & (nbits - 1);
+		words[bit / 64].fetch_or(1ULL << (bit % 64), memory_order_relaxed);
+	}
+}
+
+bool BloomFilter::mayContain(const BlockDigest& digest) const
+{
+	for (int i = 0; i < numhashes; ++i) {
+		uint64_t bit = probe(digest, i) & (nbits - 1);
+		if (!(words[bit / 64].load(memory_order_relaxed) & (1ULL << (bit % 64)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+BlockBitmap BloomFilter::fold(size_t t_nbits) const
+{
+	size_t outbits = 8;
+	while (outbits < t_nbits && outbits < nbits) {
+		outbits <<= 1;
+	}
+
+	BlockBitmap out(outbits / 8, 0);
+
+	// Bit b of the full filter lands on bit b mod outbits
+	for (size_t w = 0; w < nbits / 64; ++w) {
+		uint64_t word = words[w].load(memory_order_relaxed);
+		if (word == 0) {
+			continue;
+		}
+		for (size_t byte = 0; byte < 8; ++byte) {
+			size_t bit = w * 64 + byte * 8;
+			out[(bit % outbits) / 8] |= (unsigned char) (word >> (byte * 8));
+		}
+	}
+	return out;
+}
+
+bool BloomFilter::mayContain(const BlockBitmap& bits, int hashes, const BlockDigest& digest)
+{
+	size_t n = bits.size() * 8;
+	if (n == 0 || (n & (n - 1)) != 0) {
+		return true; // not a filter we can read; assume present
+	}
+
+	for (int i = 0; i < hashes; ++i) {
+		uint64_t bit = probe(digest, i) & (n - 1);
+		if (!bitmapTest(bits, bit)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int BloomFilter::optimalHashes(int bitsPerBlock)
+{
+	int k = (int) lround(bitsPerBlock * log(2.0));
+	return k > 0 ? k : 1;
+}
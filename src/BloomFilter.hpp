@@ -0,0 +1,55 @@
+#ifndef BLOOMFILTER_HPP
+#define BLOOMFILTER_HPP
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+#include "BlockDigest.hpp"
+#include "SurfStoreTypes.hpp"
+
+using namespace std;
+
+// Bloom filter over block digests. Bits are set with atomic ORs, so any
+// number of RPC threads can add() at once without a lock.
+//
+// The size is a power of two and bit positions are reduced with a mask,
+// so OR-ing the upper half onto the lower half gives a valid filter of
+// half the size. fold() uses that to ship a summary sized to the number
+// of blocks actually stored rather than to the configured maximum.
+class BloomFilter {
+public:
+	BloomFilter(size_t t_nbits, int t_hashes);
+
+	void add(const BlockDigest& digest);
+	bool mayContain(const BlockDigest& digest) const;
+
+	// Copy of the filter folded down to nbits (a power of two, at least 8)
+	BlockBitmap fold(size_t nbits) const;
+
+	size_t bits() const {
+		return nbits;
+	}
+	int hashes() const {
+		return numhashes;
+	}
+
+	// Membership test against a filter received as a BlockBitmap
+	static bool mayContain(const BlockBitmap& bits, int hashes, const BlockDigest& digest);
+
+	// Hash count that minimises false positives at bitsPerBlock
+	static int optimalHashes(int bitsPerBlock);
+
+protected:
+	// Position of the i-th probe before masking (double hashing on
+	// digest words not used by the store's table or shard choice)
+	static uint64_t probe(const BlockDigest& digest, int i) {
+		return digest.word(2) + i * (digest.word(3) | 1);
+	}
+
+	size_t nbits;
+	int numhashes;
+	unique_ptr<atomic<uint64_t>[]> words;
+};
+
+#endif // BLOOMFILTER_HPP
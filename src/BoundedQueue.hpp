@@ -0,0 +1,79 @@
+#ifndef BOUNDEDQUEUE_HPP
+#define BOUNDEDQUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+using namespace std;
+
+// Blocking FIFO between pipeline stages. push() waits while the queue is
+// full, so a fast producer cannot run ahead of a slow consumer by more
+// than capacity items. Once closed, push() fails and pop() drains what
+// is left, then fails.
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t t_capacity)
+		: capacity(t_capacity > 0 ? t_capacity : 1), closed(false)
+	{
+	}
+
+	bool push(T item) {
+		unique_lock<mutex> lock(mtx);
+		notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed) {
+			return false;
+		}
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	bool pop(T& item) {
+		unique_lock<mutex> lock(mtx);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// Like pop(), but fails at once when the queue is empty
+	bool tryPop(T& item) {
+		lock_guard<mutex> lock(mtx);
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// Closed with nothing left to pop
+	bool done() {
+		lock_guard<mutex> lock(mtx);
+		return closed && items.empty();
+	}
+
+	void close() {
+		lock_guard<mutex> lock(mtx);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+
+protected:
+	size_t capacity;
+	bool closed;
+	deque<T> items;
+	mutex mtx;
+	condition_variable notFull;
+	condition_variable notEmpty;
+};
+
+#endif // BOUNDEDQUEUE_HPP
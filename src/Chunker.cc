@@ -0,0 +1,93 @@
+#include "Chunker.hpp"
+
+// 256 fixed pseudo-random words (splitmix64 from a constant seed). Cut
+// points depend on this table, so it must never change: every chunk
+// stored so far was cut with it.
+static const uint64_t* gearTable()
+{
+	struct Table {
+		uint64_t gear[256];
+
+		Table() {
+			uint64_t state = 0x5375726653746f72ULL;
+			for (int i = 0; i < 256; ++i) {
+				uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				gear[i] = z ^ (z >> 31);
+			}
+		}
+	};
+	static const Table table;
+	return table.gear;
+}
+
+// Mask of the top n bits. The gear hash shifts left once per byte, so its
+// top bits depend on the most bytes.
+static uint64_t topBits(int n)
+{
+	return n <= 0 ? 0 : ~0ULL << (64 - n);
+}
+
+Chunker::Chunker(size_t t_minSize, size_t t_avgSize, size_t t_maxSize)
+	: minsize(t_minSize), avgsize(t_avgSize), maxsize(t_maxSize)
+{
+	int bits = 0;
+	while (((size_t) 2 << bits) <= avgsize) {
+		++bits;
+	}
+	maskSmall = topBits(bits + 2);
+	maskLarge = topBits(bits > 2 ? bits - 2 : 1);
+}
+
+size_t Chunker::nextChunk(const unsigned char* data, size_t len) const
+{
+	if (len <= minsize) {
+		return len;
+	}
+	if (len > maxsize) {
+		len = maxsize;
+	}
+	size_t normal = avgsize < len ? avgsize : len;
+
+	const uint64_t* gear = gearTable();
+	uint64_t fp = 0;
+	size_t i = minsize;
+
+	// Two bytes per step: the hash after the second byte is computed from
+	// the hash two bytes back, which halves the serial dependency chain.
+	// Cut points are the same as stepping one byte at a time.
+	for (; i + 1 < normal; i += 2) {
+		uint64_t g0 = gear[data[i]];
+		uint64_t g1 = gear[data[i + 1]];
+		uint64_t fp0 = (fp << 1) + g0;
+
+		fp = (fp << 2) + ((g0 << 1) + g1);
+		if (((fp0 & maskSmall) == 0) | ((fp & maskSmall) == 0)) {
+			return (fp0 & maskSmall) == 0 ? i + 1 : i + 2;
+		}
+	}
+	for (; i < normal; ++i) {
+		fp = (fp << 1) + gear[data[i]];
+		if (!(fp & maskSmall)) {
+			return i + 1;
+		}
+	}
+	for (; i + 1 < len; i += 2) {
+		uint64_t g0 = gear[data[i]];
+		uint64_t g1 = gear[data[i + 1]];
+		uint64_t fp0 = (fp << 1) + g0;
+
+		fp = (fp << 2) + ((g0 << 1) + g1);
+		if (((fp0 & maskLarge) == 0) | ((fp & maskLarge) == 0)) {
+			return (fp0 & maskLarge) == 0 ? i + 1 : i + 2;
+		}
+	}
+	for (; i < len; ++i) {
+		fp = (fp << 1) + gear[data[i]];
+		if (!(fp & maskLarge)) {
+			return i + 1;
+		}
+	}
+	return len;
+}
@@ -0,0 +1,44 @@
+#ifndef CHUNKER_HPP
+#define CHUNKER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+// Content-defined chunking (FastCDC). A gear rolling hash runs over the
+// data and a chunk ends where the hash's top bits are all zero, so cut
+// points follow the content: inserting bytes only changes the chunks
+// around the edit, not every chunk after it.
+//
+// No cut is looked for in the first minSize bytes of a chunk. Up to
+// avgSize a stricter mask is used, after it a looser one (normalized
+// chunking), which keeps chunk sizes close to avgSize. A chunk never
+// exceeds maxSize.
+class Chunker {
+public:
+	Chunker(size_t t_minSize, size_t t_avgSize, size_t t_maxSize);
+
+	// Length of the chunk starting at data, given len bytes remain
+	size_t nextChunk(const unsigned char* data, size_t len) const;
+
+	size_t minSize() const {
+		return minsize;
+	}
+	size_t avgSize() const {
+		return avgsize;
+	}
+	size_t maxSize() const {
+		return maxsize;
+	}
+
+protected:
+	size_t minsize;
+	size_t avgsize;
+	size_t maxsize;
+
+	uint64_t maskSmall; // before avgSize: more bits, cuts are rarer
+	uint64_t maskLarge; // after avgSize: fewer bits, cuts are likelier
+};
+
+#endif // CHUNKER_HPP
@@ -0,0 +1,236 @@
+#ifndef DIGESTTABLE_HPP
+#define DIGESTTABLE_HPP
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "BlockDigest.hpp"
+#include "MappedFile.hpp"
+
+using namespace std;
+
+// Flat open-addressing map from BlockDigest to a small POD value. Slots
+// live in one contiguous array and are probed linearly, so a lookup is
+// usually a single cache miss. An all-zero digest marks an empty slot and
+// cannot be stored. Entries are never removed. Not thread-safe.
+//
+// The slot array lives on the heap by default. After openMapped() it is
+// the body of a file instead, so a restarted process gets its index back
+// with one mmap and no rebuild.
+template <typename Value>
+class DigestTable {
+public:
+	struct Slot {
+		BlockDigest digest;
+		Value value;
+	};
+
+	explicit DigestTable(size_t t_capacity = 64)
+		: heap(roundCapacity(t_capacity)), slots(heap.data()), cap(heap.size()), count(0)
+	{
+	}
+
+	DigestTable(const DigestTable&) = delete;
+	DigestTable& operator=(const DigestTable&) = delete;
+
+	// Backs the table with the file at path, loading the entries it holds
+	// or creating it empty. Entries already in memory are discarded.
+	bool openMapped(const string& t_path) {
+		MappedFile file;
+		if (!file.openReadWrite(t_path, HEADER_BYTES + cap * sizeof(Slot))) {
+			return false;
+		}
+
+		Header* header = reinterpret_cast<Header*>(file.data());
+		if (header->magic[0] == '\0') {
+			initHeader(header, cap);
+		}
+		if (memcmp(header->magic, magic(), sizeof(header->magic)) != 0
+			|| header->slotSize != sizeof(Slot)
+			|| (header->capacity & (header->capacity - 1)) != 0
+			|| file.size() < HEADER_BYTES + header->capacity * sizeof(Slot)) {
+			return false;
+		}
+
+		path = t_path;
+		mapping.swap(file);
+		attach();
+		vector<Slot>().swap(heap);
+		return true;
+	}
+
+	Value* find(const BlockDigest& digest) {
+		return const_cast<Value*>(static_cast<const DigestTable*>(this)->find(digest));
+	}
+
+	const Value* find(const BlockDigest& digest) const {
+		size_t mask = cap - 1;
+
+		for (size_t i = digest.word(0) & mask; ; i = (i + 1) & mask) {
+			const Slot& slot = slots[i];
+			if (slot.digest == digest) {
+				return &slot.value;
+			}
+			if (slot.digest.empty()) {
+				return nullptr;
+			}
+		}
+	}
+
+	// Returns the value slot for digest, adding it with value if it was
+	// absent. inserted reports which of the two happened. Returns null for
+	// the empty digest or if a mapped table could not grow.
+	Value* insert(const BlockDigest& digest, const Value& value, bool& inserted) {
+		inserted = false;
+		if (digest.empty()) {
+			return nullptr;
+		}
+		if ((count + 1) * 100 > cap * MAX_LOAD_PERCENT && !grow()) {
+			return nullptr;
+		}
+
+		Slot& slot = probe(slots, cap, digest);
+		if (slot.digest.empty()) {
+			slot.digest = digest;
+			slot.value = value;
+			setCount(count + 1);
+			inserted = true;
+		}
+		return &slot.value;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	// Flushes a mapped table to disk; true for a heap one
+	bool sync() {
+		return !mapping.isOpen() || mapping.sync();
+	}
+
+	size_t capacity() const {
+		return cap;
+	}
+
+	template <typename Func>
+	void forEach(Func func) const {
+		for (size_t i = 0; i < cap; ++i) {
+			if (!slots[i].digest.empty()) {
+				func(slots[i].digest, slots[i].value);
+			}
+		}
+	}
+
+	static const size_t MAX_LOAD_PERCENT = 70;
+
+protected:
+	// On-disk layout: this header padded to HEADER_BYTES, then the slots
+	struct Header {
+		char magic[8];
+		uint64_t slotSize;
+		uint64_t capacity;
+		uint64_t count;
+	};
+
+	static const size_t HEADER_BYTES = 64;
+
+	static size_t roundCapacity(size_t n) {
+		size_t c = 16;
+		while (c < n) {
+			c <<= 1;
+		}
+		return c;
+	}
+
+	static const char* magic() {
+		return "SSDIDX1";
+	}
+
+	static void initHeader(Header* header, size_t capacity) {
+		memcpy(header->magic, magic(), sizeof(header->magic));
+		header->slotSize = sizeof(Slot);
+		header->capacity = capacity;
+		header->count = 0;
+	}
+
+	// First slot holding digest, or the empty slot where it belongs
+	static Slot& probe(Slot* table, size_t tableCap, const BlockDigest& digest) {
+		size_t mask = tableCap - 1;
+		size_t i = digest.word(0) & mask;
+
+		while (!table[i].digest.empty() && table[i].digest != digest) {
+			i = (i + 1) & mask;
+		}
+		return table[i];
+	}
+
+	static void rehash(const Slot* from, size_t fromCap, Slot* to, size_t toCap) {
+		for (size_t i = 0; i < fromCap; ++i) {
+			if (!from[i].digest.empty()) {
+				probe(to, toCap, from[i].digest) = from[i];
+			}
+		}
+	}
+
+	Header* header() const {
+		return reinterpret_cast<Header*>(mapping.data());
+	}
+
+	void attach() {
+		slots = reinterpret_cast<Slot*>(mapping.data() + HEADER_BYTES);
+		cap = header()->capacity;
+		count = header()->count;
+	}
+
+	void setCount(size_t n) {
+		count = n;
+		if (mapping.isOpen()) {
+			header()->count = n;
+		}
+	}
+
+	bool grow() {
+		if (!mapping.isOpen()) {
+			vector<Slot> bigger(cap * 2);
+			rehash(slots, cap, bigger.data(), bigger.size());
+			heap.swap(bigger);
+			slots = heap.data();
+			cap = heap.size();
+			return true;
+		}
+
+		// Rebuild into a sibling file and rename it over the old index, so
+		// a crash mid-grow leaves the previous table intact. The new file
+		// is on disk before the rename makes it the index.
+		string tmp = path + ".tmp";
+		MappedFile bigger;
+		::remove(tmp.c_str());
+		if (!bigger.openReadWrite(tmp, HEADER_BYTES + cap * 2 * sizeof(Slot))) {
+			return false;
+		}
+
+		Header* h = reinterpret_cast<Header*>(bigger.data());
+		initHeader(h, cap * 2);
+		rehash(slots, cap, reinterpret_cast<Slot*>(bigger.data() + HEADER_BYTES), h->capacity);
+		h->count = count;
+
+		if (!bigger.sync() || ::rename(tmp.c_str(), path.c_str()) != 0) {
+			return false;
+		}
+		mapping.swap(bigger);
+		attach();
+		return true;
+	}
+
+	vector<Slot> heap;
+	MappedFile mapping;
+	string path;
+
+	Slot* slots;
+	size_t cap;
+	size_t count;
+};
+
+#endif // DIGESTTABLE_HPP
@@ -5,10 +5,12 @@
 #include <algorithm>
 #include <fstream>
 #include <map>
+#include <set>
 #include <iostream>
 #include <sstream>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <assert.h>
@@ -16,16 +18,31 @@
 #include <stdlib.h>     // Random generator
 #include <time.h>       // Random seed
 #include <chrono>       // Timing library
+#include <future>
+#include <memory>
 
 #include "rpc/server.h"
 #include "rpc/rpc_error.h"
 #include "picosha2/picosha2.h"
 
 #include "logger.hpp"
+#include "BlockCodec.hpp"
+#include "BlockDigest.hpp"
+#include "BloomFilter.hpp"
+#include "BlockFetcher.hpp"
+#include "Sha256.hpp"
+#include "LinkEstimator.hpp"
+#include "HashRing.hpp"
+#include "BlockCache.hpp"
+#include "LocalIndex.hpp"
+#include "OutputFile.hpp"
 #include "Downloader.hpp"
 
 using namespace std;
 
+// Sets of k fragments tried on an erasure-coded block whose rebuilt
+// bytes do not match its hash
+static const int MAX_REBUILDS = 64;
 
 //--------------------------------------------------
 //------------------- Constructor ------------------
@@ -52,8 +69,83 @@ Downloader::Downloader(INIReader& t_config)
 	}
 	log->info("Using a block size of {}", blocksize);
 
+	// Read in the byte budget for one get_blocks batch
+	batch_bytes = (int) config.GetInteger("downloader", "batch_bytes", 1 << 20);
+	if (batch_bytes <= 0) {
+		log->error("Invalid batch size: {}", batch_bytes);
+		exit(EX_CONFIG);
+	}
+	log->info("Using a batch size of {} bytes", batch_bytes);
+
+	// Batches of blocks requested at once, across files
+	window = (int) config.GetInteger("downloader", "window", 4);
+	if (window <= 0) {
+		log->error("Invalid window: {}", window);
+		exit(EX_CONFIG);
+	}
+
+	// How to find which servers hold a block: Bloom filters or exact queries
+	locate = config.Get("downloader", "locate", "filter");
+	if (locate != "filter" && locate != "query") {
+		log->error("Invalid locate mode: {}", locate);
+		exit(EX_CONFIG);
+	}
+	log->info("Locating blocks by {}", locate);
+
+	// Fragments of an erasure-coded block asked for beyond the k needed,
+	// so one slow server does not hold up the block
+	ec_spare = (int) config.GetInteger("downloader", "ec_spare", 1);
+	if (ec_spare < 0) {
+		log->error("Invalid ec_spare: {}", ec_spare);
+		exit(EX_CONFIG);
+	}
+
+	// Latency percentile past which a block request is also sent to
+	// another replica (0: never)
+	hedge_percentile = config.GetReal("downloader", "hedge_percentile", 95);
+	if (hedge_percentile < 0 || hedge_percentile >= 100) {
+		log->error("Invalid hedge_percentile: {}", hedge_percentile);
+		exit(EX_CONFIG);
+	}
+	log->info("Hedging requests past the p{} latency", hedge_percentile);
+
+	// Servers not in use are pinged this often to track their round trips
+	// (0: only at startup)
+	probe_ms = (int) config.GetInteger("downloader", "probe_ms", 1000);
+	if (probe_ms < 0) {
+		log->error("Invalid probe_ms: {}", probe_ms);
+		exit(EX_CONFIG);
+	}
+
+	// Blocks of files already in base_dir are reused rather than fetched.
+	// They are found by cutting those files as the uploader cuts files.
+	reuse_local = config.GetBoolean("downloader", "reuse_local", true);
+	if (reuse_local && config.Get("uploader", "chunking", "fixed") == "cdc") {
+		long avg_chunk = config.GetInteger("uploader", "avg_chunk", blocksize);
+		long min_chunk = config.GetInteger("uploader", "min_chunk", avg_chunk / 4);
+		long max_chunk = config.GetInteger("uploader", "max_chunk", avg_chunk * 4);
+		if (min_chunk <= 0 || avg_chunk < min_chunk || max_chunk < avg_chunk) {
+			log->error("Invalid chunk sizes: min {} avg {} max {}", min_chunk, avg_chunk, max_chunk);
+			exit(EX_CONFIG);
+		}
+		chunker.reset(new Chunker(min_chunk, avg_chunk, max_chunk));
+	}
+
+	// Blocks fetched are kept in a cache of up to cache_mb megabytes
+	// under cache_dir, for later runs
+	cache_dir = config.Get("downloader", "cache_dir", "");
+	long cache_mb = config.GetInteger("downloader", "cache_mb", 1024);
+	if (cache_mb <= 0) {
+		log->error("Invalid cache_mb: {}", cache_mb);
+		exit(EX_CONFIG);
+	}
+	cache_bytes = (uint64_t) cache_mb << 20;
+	if (cache_dir != "") {
+		log->info("Caching up to {} MB of blocks in {}", cache_mb, cache_dir);
+	}
+
 	num_servers = (int) config.GetInteger("ssd", "num_servers", -1);
-	if (num_servers <= 0) {
+	if (num_servers <= 0 || num_servers > MAX_SERVERS) {
 		log->error("num_servers {} is invalid", num_servers);
 		exit(EX_CONFIG);
 	}
@@ -82,52 +174,127 @@ Downloader::Downloader(INIReader& t_config)
 		ssdports.push_back(port);
 	}
 
+	// The ring ring(r) files were placed on, if the servers are the same
+	int vnodes = (int) config.GetInteger("ssd", "vnodes", HashRing::DEFAULT_VNODES);
+	if (vnodes <= 0) {
+		log->error("Invalid vnodes: {}", vnodes);
+		exit(EX_CONFIG);
+	}
+	vector<string> names, zones;
+	for (int i = 0; i < num_servers; ++i) {
+		names.push_back(ssdhosts[i] + ":" + std::to_string(ssdports[i]));
+		zones.push_back(config.Get("ssd", "zone"+std::to_string(i), ""));
+	}
+	ring.reset(new HashRing(names, zones, vnodes));
+
 	log->info("Downloader initalized");
 }
 
-//-----------------------------------------                                     
-//----- Get local server based on RTT -----                                     
-//-----------------------------------------                                     
-                                                                                
-int Downloader::getLocalServer(vector<double> RTT){                               
-                                                                                
-    int locServer = 0;                                                          
-                                                                                
-    for (int n = 1; n < num_servers; ++n){                                      
-        if(RTT[locServer] > RTT[n]){                                            
-            locServer = n;                                                      
-        }                                                                       
-    }                                                                           
-    return locServer;                                                           
+//---------------------------------------------
+//-- Servers that may hold a block, by index --
+//---------------------------------------------
+vector<int> Downloader::holders(const ReplicaIndex& replicas, const string& hash){
+
+	vector<int> servers;
+	BlockDigest digest;
+
+	if (!BlockDigest::fromHex(hash, digest)){
+		return servers;
+	}
+	const ReplicaSet* found = replicas.find(digest);
+	if (found == nullptr){
+		return servers;
+	}
+	for (int s = 0; s < num_servers; s++){
+		if (*found & ((ReplicaSet) 1 << s)){
+			servers.push_back(s);
+		}
+	}
+	return servers;
 }
 
-//-------------------------------------------------
-//-- Get list of servers in ascending RTT order --
-//------------------------------------------------
-list <int> Downloader::getServerOrder(vector<double> RTT){
+//-------------------------------------------------------
+//-- Wait for a reply from server, until deadline --------
+//-------------------------------------------------------
+template <typename T>
+static bool awaitReply(future<RPCLIB_MSGPACK::object_handle>& reply, std::chrono::steady_clock::time_point deadline,
+                       int server, const char* what, T& result){
 
 	auto log = logger();
 
-	list<int> servers;
+	if (reply.wait_until(deadline) != future_status::ready){
+		log->error("{} server {} timed out", what, server);
+		return false;
+	}
+	try {
+		result = reply.get().as<T>();
+	} catch (rpc::rpc_error& e) {
+		log->error("{} server {} failed: {}", what, server, e.what());
+		return false;
+	} catch (std::exception& e) {
+		log->error("{} server {} failed: {}", what, server, e.what());
+		return false;
+	}
+	return true;
+}
 
-	for (int i = 0; i < num_servers; i++) {
-		
-		int order = 0;
-		for (int n = 0; n < num_servers; n++){
-			
-			if(RTT[i] > RTT[n]){
-				order++;
-			} 
+//----------------------------------------------------------
+//-- Ask servers which of the given blocks they hold -------
+//----------------------------------------------------------
+map<int, vector<bool>> Downloader::hasBlocks(const vector<rpc::client*>& clients, const vector<int>& servers,
+                                             const vector<string>& hashes){
+
+	auto log = logger();
+
+	// Keep each query within the batch budget (hex hashes are 64 bytes)
+	size_t window = std::max(1, batch_bytes / 64);
+
+	map<int, vector<future<RPCLIB_MSGPACK::object_handle>>> replies;
+
+	for (int s : servers){
+		log->info("Querying {} blocks on server {}", hashes.size(), s);
+		try {
+			for (size_t first = 0; first < hashes.size(); first += window) {
+				size_t last = std::min(hashes.size(), first + window);
+				vector<string> batch(hashes.begin() + first, hashes.begin() + last);
+				replies[s].push_back(clients[s]->async_call("has_blocks", batch));
+			}
+		} catch (std::exception& e) {
+			log->error("Querying server {} failed: {}", s, e.what());
+			replies.erase(s);
 		}
-		servers.push_back(order);
 	}
-	return servers;
+
+	// Each reply may take up to RPC_TIMEOUT after the one before it
+	map<int, vector<bool>> has;
+
+	for (auto& entry : replies){
+		vector<bool> bits(hashes.size(), false);
+		size_t first = 0;
+
+		for (auto& reply : entry.second){
+			BlockBitmap bitmap;
+			if (!awaitReply(reply, std::chrono::steady_clock::now() + std::chrono::milliseconds(RPC_TIMEOUT),
+			                entry.first, "Querying", bitmap)){
+				break;
+			}
+			size_t last = std::min(hashes.size(), first + window);
+			for (size_t i = first; i < last; i++){
+				bits[i] = bitmapTest(bitmap, i - first);
+			}
+			first = last;
+		}
+		if (first == hashes.size()){
+			has[entry.first].swap(bits);
+		}
+	}
+	return has;
 }
 
 //------------------------------------------------
 //----------- Main download function -------------
 //------------------------------------------------
-void Downloader::download()
+bool Downloader::download()
 {
 	auto log = logger();
 
@@ -146,138 +313,505 @@ void Downloader::download()
 		}
 	}
 
-	// Issue a ping to each server
-	for (int i = 0; i < num_servers; ++i)
-	{
-		log->info("Pinging server {}", i);
+	// Time every server at once, then keep timing them in the background
+	LinkEstimator links(num_servers);
+	vector<bool> answered = links.probe(clients, RPC_TIMEOUT);
+
+	// A server that does not answer is left out: its blocks come from
+	// other replicas, or are rebuilt from other fragments
+	size_t live = 0;
+	for (int n = 0; n < num_servers; ++n){
+		if (!answered[n]){
+			log->error("Error pinging server {}, fetching from the others", n);
+			continue;
+		}
+		live++;
+		log->info("RTT for server {}: {} ms", n, links.rtt(n));
+	}
+	if (live == 0){
+		log->error("No server is answering");
+		exit(EX_UNAVAILABLE);
+	}
+	if (probe_ms > 0){
+		links.start(ssdhosts, ssdports, probe_ms, RPC_TIMEOUT);
+	}
+
+	// Get file info map from the nearest server that answers
+	FileInfoMap remoteMap;
+	bool mapped = false;
+	for (int s : links.order()){
+		if (!answered[s]){
+			continue;
+		}
 		try {
-			clients[i]->call("ping");
-			log->info("  success");
-		} catch (rpc::timeout &t) {
-			log->error("Error pinging server {}: {}", i, t.what());
-			exit(-1);
+			remoteMap = clients[s]->call("get_fileinfo_map").as<FileInfoMap>();
+			mapped = true;
+			break;
+		} catch (std::exception& e) {
+			log->error("get_fileinfo_map on server {} failed: {}", s, e.what());
+		}
+	}
+	if (!mapped){
+		exit(EX_UNAVAILABLE);
+	}
+
+	// Block size of each file cut into fixed blocks, taken out of its
+	// hash list so the lists only hold placement markers and hashes
+	map<string, uint64_t> fixedBytes;
+
+	for (auto& entry : remoteMap){
+		list<string>& hash_list = get<1>(entry.second);
+		auto it = hash_list.begin();
+		int count, parity;
+		string print;
+		if (it != hash_list.end() && (ReedSolomon::parse(*it, count, parity) || HashRing::parseMarker(*it, count, print))){
+			++it;
+		}
+		uint64_t bytes;
+		if (it != hash_list.end() && parseFixedMarker(*it, bytes)){
+			fixedBytes[entry.first] = bytes;
+			hash_list.erase(it);
 		}
 	}
 
+	// Every distinct block the files list
+	DigestTable<uint8_t> listed;
 
+	for (auto& entry : remoteMap){
+		const list<string>& hash_list = get<1>(entry.second);
+		int ec_k, ec_m;
+		auto it = hash_list.begin();
+		if (!hash_list.empty() && ReedSolomon::parse(hash_list.front(), ec_k, ec_m)){
+			++it;
+		}
+		for (; it != hash_list.end(); ++it){
+			BlockDigest digest;
+			bool inserted;
+			if (BlockDigest::fromHex(*it, digest)){
+				listed.insert(digest, 0, inserted);
+			}
+		}
+	}
 
-	//-----------------------------------                                       
-	//-- Classify Servers based on RTT --                                       
-	//-----------------------------------                                       
+	// Blocks on hand need not be fetched: those of local files, then
+	// those cached by earlier runs
+	LocalIndex local(blocksize, chunker.get());
+	BlockCache cache;
 
-	vector<double> avgRTT;                                                      
+	if (reuse_local){
+		auto indexStart = std::chrono::steady_clock::now();
+		size_t found = 0;
 
-	log->info("Calculating average RTTs");                                    
+		if (auto dir = opendir(base_dir.c_str())){
+			while (auto f = readdir(dir)){
+				string name = f->d_name;
 
-	for (int n = 0; n < num_servers; ++n){                                      
+				// Partial downloads are rewritten, so not safe to map
+				if (name[0] == '.' || (name.size() > 5 && name.compare(name.size() - 5, 5, ".part") == 0))
+					continue;
 
-		log->info("Ping timing for server {}", n);                              
+				size_t added = 0;
+				local.add(base_dir + "/" + name, [&](const BlockDigest& digest){
+					return listed.find(digest) != nullptr;
+				}, added);
+				found += added;
+			}
+			closedir(dir);
+		}
+		log->info("Found {} blocks in local files in {} ms", found,
+		          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - indexStart).count());
+	}
 
-		int ping_num = 8;                                                       
-		std::chrono::duration<double> elapsed;                                  
-		double avg = 0.0;                                                       
+	if (cache_dir != "" && !cache.open(cache_dir, cache_bytes)){
+		log->error("Unable to open block cache in {}: {}", cache_dir, strerror(errno));
+	}
 
-		for (int i = 0; i < ping_num; ++i){                                     
+	// Cached blocks are located all the same: storing the blocks fetched
+	// may evict them before they are read
+	auto onHand = [&](const string& hash){
+		BlockDigest digest;
+		return BlockDigest::fromHex(hash, digest) && local.contains(digest);
+	};
+
+	// Every distinct block to fetch, with the servers that may hold each
+	// indexed by raw digest
+	vector<string> wanted;
+	vector<BlockDigest> digests;
+	ReplicaIndex replicas;
+
+	auto want = [&](const string& hash){
+		BlockDigest digest;
+		bool inserted;
+		if (BlockDigest::fromHex(hash, digest) && replicas.insert(digest, 0, inserted) && inserted){
+			wanted.push_back(hash);
+			digests.push_back(digest);
+		}
+	};
 
-			try {                                                               
+	size_t computed = 0;
 
-				// Record start time                                            
-				auto start = std::chrono::high_resolution_clock::now();         
+	for (auto& entry : remoteMap){
+		const list<string>& hash_list = get<1>(entry.second);
 
-				clients[n]->call("ping");                                       
+		// An erasure-coded file needs the fragments of its blocks
+		int ec_k, ec_m;
+		if (!hash_list.empty() && ReedSolomon::parse(hash_list.front(), ec_k, ec_m)){
+			ReedSolomon code(ec_k, ec_m);
+			for (auto it = std::next(hash_list.begin()); it != hash_list.end(); ++it){
+				if (onHand(*it)){
+					continue;
+				}
+				for (int f = 0; f < code.fragments(); f++){
+					want(code.fragmentHash(*it, f));
+				}
+			}
+			continue;
+		}
 
-				// Record end time                                              
-				auto finish = std::chrono::high_resolution_clock::now();        
+		// A ring-placed file's blocks are where this ring puts them, as long
+		// as it is the ring they were placed with
+		int ring_r;
+		string print;
+		if (!hash_list.empty() && HashRing::parseMarker(hash_list.front(), ring_r, print)){
+			if (print == ring->fingerprint()){
+				for (auto it = std::next(hash_list.begin()); it != hash_list.end(); ++it){
+					BlockDigest digest;
+					bool inserted;
+					if (onHand(*it) || !BlockDigest::fromHex(*it, digest)){
+						continue;
+					}
+					ReplicaSet* holders = replicas.insert(digest, 0, inserted);
+					if (holders != nullptr){
+						for (int s : ring->replicas(digest, ring_r)){
+							if (answered[s]){
+								*holders |= (ReplicaSet) 1 << s;
+							}
+						}
+						computed++;
+					}
+				}
+				continue;
+			}
+			log->info("{} was placed on another ring, locating its blocks", entry.first);
+		}
 
-				elapsed = finish - start;                                       
+		for (auto& hash : hash_list){
+			if (!onHand(hash)){
+				want(hash);
+			}
+		}
+	}
+	if (computed > 0){
+		log->info("Computed the replicas of {} blocks from the ring", computed);
+	}
 
-				avg = avg + (elapsed.count()*1000)/ping_num;                    
-				log->info("Ping {}: {}", i+1, (elapsed.count()*1000));        
+	auto locateStart = std::chrono::steady_clock::now();
 
-			} catch (rpc::timeout &t) {                                         
-				log->error("Error pinging server {}: {}", 0, t.what());         
-				exit(-1);                                                       
-			}                                                                   
-		}                                                                       
-		avgRTT.push_back(avg);                                                  
-		log->info("Server {} avg RTT: {}ms", n, avg);                           
-	}                                                                           
+	// Nothing to locate, as when every file is ring-placed: no round trips
+	vector<int> order;
+	if (!wanted.empty()){
+		for (int s : links.order()){
+			if (answered[s]){
+				order.push_back(s);
+			}
+		}
+	}
 
-	// Print Results                                                            
-	for (int n = 0; n < num_servers; ++n){                                      
-		log->info("Average RTT for server {}: {}", n, avgRTT[n]);               
+	// Every server is asked at once, so locating costs about one round
+	// trip plus the transfer rather than one per server. A server that
+	// does not answer holds nothing as far as this run is concerned;
+	// other replicas may.
+	if (locate == "query" && !order.empty()){
+
+		// Ask the servers exactly which of those blocks they hold
+		for (auto& entry : hasBlocks(clients, order, wanted)){
+			ReplicaSet server = (ReplicaSet) 1 << entry.first;
+			for (size_t i = 0; i < wanted.size(); i++){
+				if (entry.second[i]){
+					*replicas.find(digests[i]) |= server;
+				}
+			}
+		}
 	}
+	else if (!order.empty()){
+
+		// Test the blocks locally against each server's Bloom filter
+		map<int, future<RPCLIB_MSGPACK::object_handle>> replies;
+		for (int s : order){
+			try {
+				replies[s] = clients[s]->async_call("get_block_filter");
+			} catch (std::exception& e) {
+				log->error("Filter of server {} failed: {}", s, e.what());
+			}
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RPC_TIMEOUT);
+
+		for (auto& entry : replies){
+			int s = entry.first;
+			ReplicaSet server = (ReplicaSet) 1 << s;
 
-	// Get local server
-	int localServer = getLocalServer(avgRTT);
+			BlockFilterSummary summary;
+			if (!awaitReply(entry.second, deadline, s, "Filter of", summary)){
+				continue;
+			}
+			log->info("Server {} filter: {} bytes", s, get<1>(summary).size());
 
-	// Get file info map from localhost
-	FileInfoMap remoteMap = clients[localServer]->call("get_fileinfo_map").as<FileInfoMap>();;
+			for (size_t i = 0; i < wanted.size(); i++){
+				if (BloomFilter::mayContain(get<1>(summary), get<0>(summary), digests[i])){
+					*replicas.find(digests[i]) |= server;
+				}
+			}
+		}
+	}
 
-	// Get list of server block maps
-	map<int, list<string>> blockMapList;
+	log->info("Located {} blocks in {} ms", wanted.size(),
+	          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - locateStart).count());
 	
-	for (int n = 0; n < num_servers; ++n){ 
-		
-		log->info("Getting blocks from client {}", n);
-		
-		list<string> blocklist = clients[n]->call("get_stored_blocks").as<list<string>>();
-		
-		blockMapList[n] = blocklist;
+	// Servers that can send blocks as stored, compressed ones included;
+	// older ones, which lack get_codecs, send them raw through get_blocks
+	vector<bool> coded(num_servers, false);
+
+	for (int n = 0; n < num_servers; n++){
+		if (!answered[n]){
+			continue;
+		}
+		try {
+			vector<string> codecs = clients[n]->call("get_codecs").as<vector<string>>();
+			coded[n] = find(codecs.begin(), codecs.end(), "lz4") != codecs.end();
+		} catch (std::exception& e) {
+			log->info("Server {} sends raw blocks only", n);
+		}
 	}
 
-	list<int> orderServers = getServerOrder(avgRTT);
-	
 	//----------------------------------
 	//-- Go through files to download --
 	//----------------------------------
 
 	log->info("Download from Server");
 
+	unique_ptr<BlockFetcher> fetcher(new BlockFetcher(clients, coded, links, batch_bytes, hedge_percentile, RPC_TIMEOUT));
+
+	// A file being downloaded; its jobs are tagged file << 32 | block
+	struct Download {
+		string name;
+		vector<string> hashes;
+		unique_ptr<ReedSolomon> code; // erasure-coded files name it first
+		uint64_t blockBytes; // as the uploader cut it; blocksize, about, for content-defined blocks
+		OutputFile out;
+	};
+	vector<unique_ptr<Download>> files;
+
 	// Timing purposes
         auto start = std::chrono::high_resolution_clock::now();
 
+	// Blocks of up to window batches are in flight at once, from as many
+	// files as that spans. Blocks arrive in any order and are written in
+	// place; those of content-defined files held for an earlier block
+	// count against the window.
+	uint64_t inflight = (uint64_t) window * batch_bytes;
+	uint64_t held = 0;
+	size_t nextBlock = 0; // of the newest file
+	vector<FetchJob> done;
+	size_t fromLocal = 0, fromCache = 0, fetched = 0;
+	size_t failed = 0; // files left as they were
+
+	// A file missing a block is not written at all
+	auto deliver = [&](Download& file, size_t index, string& block){
+		held -= file.out.held();
+		if (block.empty()){
+			log->error("Block {} of {} not found on any server", file.hashes[index], file.name);
+			file.out.fail(index);
+		}
+		else if (!file.out.put(index, block)){
+			log->error("Unable to write {}: {}", file.name, strerror(errno));
+		}
+		held += file.out.held();
+
+		if (file.out.complete()){
+			bool missing = file.out.failed();
+			if (!file.out.close()){
+				if (missing){
+					log->error("Download of {} failed; left as it was", file.name);
+				}
+				else{
+					log->error("Unable to write {}: {}", file.name, strerror(errno));
+				}
+				failed++;
+			}
+		}
+	};
+
+	// Rebuilds an erasure-coded block from k of the fragments got; while
+	// the result does not match its hash, as when a fragment is corrupt,
+	// tries other sets of k
+	auto rebuild = [&](Download& file, const FetchJob& job, const string& hash, string& block){
+		vector<int> indexes;
+		vector<const string*> fragments;
+		for (auto& entry : job.got){
+			indexes.push_back(entry.first);
+			fragments.push_back(&entry.second);
+		}
+		int n = (int) indexes.size();
+		int k = file.code->dataFragments();
+		vector<int> pick;
+		for (int i = 0; i < k; i++){
+			pick.push_back(i);
+		}
+
+		for (int tries = 0; tries < MAX_REBUILDS; tries++){
+			vector<int> someIndexes;
+			vector<const string*> someFragments;
+			for (int i : pick){
+				someIndexes.push_back(indexes[i]);
+				someFragments.push_back(fragments[i]);
+			}
+			if (file.code->decode(someIndexes, someFragments, block) && Sha256::hashHex(block.data(), block.size()) == hash){
+				return true;
+			}
+
+			// Next set in lexicographic order
+			int i = k - 1;
+			while (i >= 0 && pick[i] == n - k + i){
+				i--;
+			}
+			if (i < 0){
+				break;
+			}
+			pick[i]++;
+			for (int j = i + 1; j < k; j++){
+				pick[j] = pick[j - 1] + 1;
+			}
+		}
+		block.clear();
+		return false;
+	};
+
 	auto rem_it = remoteMap.begin();
 
-	while( rem_it != remoteMap.end()){
+	while (true) {
 
-		// Get filename and hash list
-		string remote_filename = rem_it->first;
-		list<string> hash_list = get<1>(remoteMap[remote_filename]);
+		while (fetcher->queuedBytes() + held < inflight){
 
-		map<int, string> downBlocks;
+			if (files.empty() || nextBlock == files.back()->hashes.size()){
 
-		// File to be created
-		std::ofstream out(base_dir +"/"+ remote_filename);
+				if (rem_it == remoteMap.end()){
+					break;
+				}
 
-		
-		// Iterate through all hashes
-		for (auto it = hash_list.begin(); it != hash_list.end(); it++){
-	
-			string hash = it->c_str();
-
-			int downloaded = 0;
-			for (std::list<int>::iterator s_it = orderServers.begin(); s_it != orderServers.end(); ++s_it){
-				
-				if(downloaded == 0){
-					int s = *s_it;
-				
-					list<string> blockmap = blockMapList[s];
-	
-					if( std::find(blockmap.begin(), blockmap.end(), hash) != blockmap.end() ){
-			
-						string block = clients[s]->call("get_block", hash).as<string>();
-						out << block;
-					
-						downloaded = 1;
-								
+				// Get filename and hash list
+				unique_ptr<Download> file(new Download);
+				file->name = rem_it->first;
+				const list<string>& hash_list = get<1>(rem_it->second);
+				file->hashes.assign(hash_list.begin(), hash_list.end());
+				rem_it++;
+
+				int ec_k, ec_m;
+				if (!file->hashes.empty() && ReedSolomon::parse(file->hashes.front(), ec_k, ec_m)){
+					file->code.reset(new ReedSolomon(ec_k, ec_m));
+					file->hashes.erase(file->hashes.begin());
+				}
+				int ring_r;
+				string print;
+				if (!file->hashes.empty() && HashRing::parseMarker(file->hashes.front(), ring_r, print)){
+					file->hashes.erase(file->hashes.begin());
+				}
+
+				// File to be created, sized for full blocks. Fixed blocks are
+				// written at their offsets as they arrive.
+				auto fixed = fixedBytes.find(file->name);
+				bool isFixed = fixed != fixedBytes.end();
+				file->blockBytes = isFixed ? fixed->second : blocksize;
+				uint64_t expected = (uint64_t) file->hashes.size() * file->blockBytes;
+				if (!file->out.open(base_dir + "/" + file->name, file->hashes.size(), expected, isFixed ? file->blockBytes : 0)){
+					log->error("Unable to create {}: {}", file->name, strerror(errno));
+					file->hashes.clear();
+					failed++;
+				}
+				if (file->out.complete()){
+					file->out.close();
+				}
+				files.push_back(std::move(file));
+				nextBlock = 0;
+				continue;
+			}
+
+			Download& file = *files.back();
+			const string& hash = file.hashes[nextBlock];
+
+			BlockDigest digest;
+			string block;
+			if (BlockDigest::fromHex(hash, digest)){
+				if (local.get(digest, block)){
+					fromLocal++;
+				}
+				else if (cache.isOpen() && cache.get(digest, block)){
+					fromCache++;
+				}
+			}
+			if (!block.empty()){
+				deliver(file, nextBlock++, block);
+				continue;
+			}
+
+			// A replicated block is one piece on each of its replicas; an
+			// erasure-coded one is any k of its fragments
+			FetchJob job;
+			int pieces = file.code ? file.code->fragments() : 1;
+
+			for (int f = 0; f < pieces; f++){
+				FetchPiece piece;
+				piece.hash = file.code ? file.code->fragmentHash(hash, f) : hash;
+				piece.holders = holders(replicas, piece.hash);
+				job.pieces.push_back(piece);
+			}
+			job.need = file.code ? file.code->dataFragments() : 1;
+			job.spare = file.code ? ec_spare : 0;
+			job.bytes = file.code ? ReedSolomon::HEADER + file.blockBytes / job.need + 1 : file.blockBytes;
+			// Fragments are stored under derived names; their block is
+			// checked once rebuilt
+			job.verify = !file.code;
+			job.tag = (uint64_t) (files.size() - 1) << 32 | nextBlock;
+			fetcher->submit(std::move(job));
+			nextBlock++;
+		}
+
+		if (fetcher->queued() == 0){
+			break;
+		}
+
+		fetcher->step(done);
+
+		for (auto& job : done){
+			Download& file = *files[job.tag >> 32];
+			size_t index = job.tag & 0xffffffff;
+			string block;
+
+			if (job.got.size() >= job.need){
+				if (!file.code){
+					block.swap(job.got.begin()->second);
+				}
+				else if (!rebuild(file, job, file.hashes[index], block)){
+					// Like a missing fragment: ask for one more, while any is left
+					if (job.got.size() < (size_t) file.code->fragments()){
+						log->warn("Fragments of {} do not rebuild it, fetching another", file.hashes[index]);
+						job.need = job.got.size() + 1;
+						job.spare = 0;
+						fetcher->submit(std::move(job));
+						continue;
 					}
+					log->error("Fragments of {} do not rebuild it", file.hashes[index]);
+				}
+			}
+			if (!block.empty()){
+				fetched++;
+				BlockDigest digest;
+				if (cache.isOpen() && BlockDigest::fromHex(file.hashes[index], digest) && !cache.put(digest, block)){
+					log->error("Unable to cache {}: {}", file.hashes[index], strerror(errno));
 				}
 			}
+			deliver(file, index, block);
 		}
-			
-		out.close();
-		rem_it++;
+		done.clear();
 	}
 
 	auto finish = std::chrono::high_resolution_clock::now();
@@ -287,10 +821,28 @@ void Downloader::download()
 
         log->info("Download time: {}", finaltime);
 
+	for (int n = 0; n < num_servers; ++n){
+		log->info("Received {} bytes from server {}", fetcher->received(n), n);
+	}
+	log->info("Hedged {} requests", fetcher->hedged());
+	for (int n = 0; n < num_servers; ++n){
+		log->info("Server {}: RTT {} ms (p50 {}, p99 {}), {} bytes/ms", n, links.rtt(n),
+		          links.rttPercentile(n, 50), links.rttPercentile(n, 99), links.bandwidth(n));
+	}
+	log->info("Blocks from local files: {}, from the cache: {}, fetched: {}", fromLocal, fromCache, fetched);
+	if (failed > 0){
+		log->error("{} files could not be downloaded", failed);
+	}
+
+	// Drop the calls still out before their clients go
+	fetcher.reset();
+	links.stop();
+
 	// Delete the clients
 	for (int i = 0; i < num_servers; ++i)
 	{
 		log->info("Tearing down client {}", i);
 		delete clients[i];
 	}
+	return failed == 0;
 }
@@ -1,6 +1,8 @@
 #ifndef DOWNLOADER_HPP
 #define DOWNLOADER_HPP
 
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -8,21 +10,36 @@
 #include "rpc/client.h"
 
 #include "SurfStoreTypes.hpp"
+#include "Chunker.hpp"
+#include "DigestTable.hpp"
+#include "HashRing.hpp"
+#include "ReedSolomon.hpp"
 #include "logger.hpp"
 
 using namespace std;
 
+// Servers that may hold a block, bit n for server n
+typedef uint64_t ReplicaSet;
+typedef DigestTable<ReplicaSet> ReplicaIndex;
+
 class Downloader {
 public:
     Downloader(INIReader& t_config);
 
-	void download();
+	// False if some files could not be downloaded
+	bool download();
+
+	// Servers the index says may hold the block with hex hash hash
+	vector<int> holders(const ReplicaIndex& replicas, const string& hash);
+
+	// Which of hashes each of servers holds, queried in batch_bytes
+	// chunks sent to every server before any reply is waited for. A
+	// server that fails or stops answering is left out.
+	map<int, vector<bool>> hasBlocks(const vector<rpc::client*>& clients, const vector<int>& servers,
+	                                 const vector<string>& hashes);
 
-	// Getter for local server
-	int getLocalServer(vector<double> RTT);
-	list <int> getServerOrder(vector<double> RTT);
-	
 	const uint64_t RPC_TIMEOUT = 10000; // milliseconds
+	static const int MAX_SERVERS = 64;  // bits in a ReplicaSet
 
 protected:
 
@@ -30,10 +47,22 @@ protected:
 
 	string base_dir;
 	int blocksize;
+	int batch_bytes;
+	int window;
+	string locate;
+	int ec_spare; // fragments asked for beyond k
+	double hedge_percentile;
+	int probe_ms;
+
+	bool reuse_local;            // take blocks from files already in base_dir
+	unique_ptr<Chunker> chunker; // how the uploader cut them, if by content
+	string cache_dir;            // empty: no block cache
+	uint64_t cache_bytes;
 
 	int num_servers;
 	vector<string> ssdhosts;
 	vector<int> ssdports;
+	unique_ptr<HashRing> ring;
 };
 
 #endif // DOWNLOADER_HPP
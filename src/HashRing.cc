@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+
+#include "HashRing.hpp"
+#include "Sha256.hpp"
+
+// Ring position of a 32-byte hash: its first 8 bytes, big endian
+static uint64_t position(const uint8_t* hash)
+{
+	uint64_t p = 0;
+	for (int i = 0; i < 8; i++) {
+		p = p << 8 | hash[i];
+	}
+	return p;
+}
+
+HashRing::HashRing(const vector<string>& names, const vector<string>& t_zones, int vnodes)
+	: numZones(0)
+{
+	// A server without a zone is a zone of its own
+	map<string, int> zoneNumbers;
+	string description = "vnodes=" + to_string(vnodes) + "\n";
+
+	for (size_t s = 0; s < names.size(); s++) {
+		string zone = s < t_zones.size() ? t_zones[s] : "";
+		if (zone.empty()) {
+			zones.push_back(numZones++);
+		} else {
+			auto found = zoneNumbers.find(zone);
+			if (found == zoneNumbers.end()) {
+				found = zoneNumbers.insert(make_pair(zone, numZones++)).first;
+			}
+			zones.push_back(found->second);
+		}
+		description += names[s] + " " + zone + "\n";
+
+		for (int v = 0; v < vnodes; v++) {
+			string point = names[s] + "#" + to_string(v);
+			uint8_t hash[Sha256::SIZE];
+			Sha256::hash(point.data(), point.size(), hash);
+			points.push_back(make_pair(position(hash), (int) s));
+		}
+	}
+	sort(points.begin(), points.end());
+
+	print = Sha256::hashHex(description.data(), description.size()).substr(0, 16);
+}
+
+bool HashRing::parse(const string& policy, int& replicas)
+{
+	int used = 0;
+	if (sscanf(policy.c_str(), "ring(%d)%n", &replicas, &used) != 1 || used != (int) policy.size()) {
+		return false;
+	}
+	return replicas >= 1;
+}
+
+bool HashRing::parseMarker(const string& marker, int& replicas, string& fingerprint)
+{
+	char print[17];
+	int used = 0;
+	if (sscanf(marker.c_str(), "ring(%d,%16[0-9a-f])%n", &replicas, print, &used) != 2 || used != (int) marker.size()) {
+		return false;
+	}
+	fingerprint = print;
+	return replicas >= 1;
+}
+
+string HashRing::marker(int replicas) const
+{
+	return "ring(" + to_string(replicas) + "," + print + ")";
+}
+
+vector<int> HashRing::replicas(const BlockDigest& digest, int count) const
+{
+	vector<int> chosen;
+	if (points.empty()) {
+		return chosen;
+	}
+	count = min(count, (int) zones.size());
+
+	vector<bool> used(zones.size(), false);
+	vector<bool> zoneUsed(numZones, false);
+	int zonesLeft = numZones;
+
+	// Walk clockwise from the block; while zones are left, skip servers in
+	// zones that already have a replica, then take any server not used
+	size_t start = upper_bound(points.begin(), points.end(), make_pair(position(digest.bytes), -1)) - points.begin();
+	for (int pass = 0; pass < 2 && (int) chosen.size() < count; pass++) {
+		for (size_t i = 0; i < points.size() && (int) chosen.size() < count; i++) {
+			int s = points[(start + i) % points.size()].second;
+			if (used[s] || (pass == 0 && zonesLeft > 0 && zoneUsed[zones[s]])) {
+				continue;
+			}
+			if (pass == 0 && zonesLeft == 0) {
+				break;
+			}
+			used[s] = true;
+			chosen.push_back(s);
+			if (!zoneUsed[zones[s]]) {
+				zoneUsed[zones[s]] = true;
+				zonesLeft--;
+			}
+		}
+	}
+	return chosen;
+}
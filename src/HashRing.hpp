@@ -0,0 +1,58 @@
+#ifndef HASHRING_HPP
+#define HASHRING_HPP
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BlockDigest.hpp"
+
+using namespace std;
+
+// Consistent-hashing ring for the ring(r) placement policy. Each server
+// is placed at vnodes points on a 64-bit ring, hashed from its name (the
+// host:port of its [ssd] entry), and a block's r replicas are the first
+// r distinct servers clockwise from the block's own hash. Clients with
+// the same server list compute the same replicas, so blocks are found
+// without asking the servers, and adding a server moves only the blocks
+// its points take over, about 1/N of them.
+//
+// Servers may be given zones (regions). Replicas then go to distinct
+// zones while there are zones left, so a block survives the loss of a
+// region.
+class HashRing {
+public:
+	static const int DEFAULT_VNODES = 128;
+
+	HashRing(const vector<string>& names, const vector<string>& zones, int vnodes);
+
+	// Parses ring(r); false if policy is not one
+	static bool parse(const string& policy, int& replicas);
+	// Parses ring(r,fingerprint), as hash lists are marked
+	static bool parseMarker(const string& marker, int& replicas, string& fingerprint);
+
+	// Marks a hash list placed with r replicas on this ring
+	string marker(int replicas) const;
+
+	// Identifies the server names, zones and vnodes; rings with the same
+	// fingerprint place every block alike
+	const string& fingerprint() const {
+		return print;
+	}
+
+	// The first replicas distinct servers for a block, in ring order
+	vector<int> replicas(const BlockDigest& digest, int count) const;
+
+	size_t servers() const {
+		return zones.size();
+	}
+
+protected:
+	vector<pair<uint64_t, int>> points; // sorted by position
+	vector<int> zones;                  // zone number of each server
+	int numZones;
+	string print;
+};
+
+#endif // HASHRING_HPP
@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <future>
+#include <memory>
+
+#include "LinkEstimator.hpp"
+
+// Bandwidth assumed when no server was measured yet: 1 MB/s
+static const double DEFAULT_BANDWIDTH = 1000;
+
+// Replies up to this size are round trip samples; larger ones are
+// throughput samples
+static const size_t SMALL_CALL_BYTES = 16 << 10;
+
+// Round trip samples kept per server for percentiles
+static const size_t RTT_SAMPLES = 64;
+
+// Weight of a new sample in the EWMAs
+static const double EWMA_WEIGHT = 0.25;
+
+// Wait between checks for ping replies
+static const chrono::microseconds POLL(50);
+
+LinkEstimator::LinkEstimator(size_t servers)
+	: links(servers), stopping(false)
+{
+	for (auto& link : links) {
+		link.rtt = 0;
+		link.nextRtt = 0;
+		link.bandwidth = 0;
+	}
+}
+
+LinkEstimator::~LinkEstimator()
+{
+	stop();
+}
+
+//-----------------------------------------------------------------
+//--------------------------- Probing -----------------------------
+//-----------------------------------------------------------------
+
+vector<bool> LinkEstimator::probe(const vector<rpc::client*>& clients, uint64_t timeoutMs)
+{
+	return ping(clients, timeoutMs, true);
+}
+
+vector<bool> LinkEstimator::ping(const vector<rpc::client*>& clients, uint64_t timeoutMs, bool connecting)
+{
+	vector<bool> answered(clients.size(), false);
+	vector<future<RPCLIB_MSGPACK::object_handle>> replies(clients.size());
+	vector<chrono::steady_clock::time_point> sent(clients.size());
+
+	// async_call waits for the connection, so the time is taken after it
+	for (size_t s = 0; s < clients.size(); s++) {
+		if (!connecting && clients[s]->get_connection_state() != rpc::client::connection_state::connected) {
+			continue;
+		}
+		try {
+			replies[s] = clients[s]->async_call("ping");
+			sent[s] = chrono::steady_clock::now();
+		} catch (std::exception& e) {
+			replies[s] = future<RPCLIB_MSGPACK::object_handle>();
+		}
+	}
+
+	// Replies are polled together, so each is timed when it lands rather
+	// than when the ones before it were taken
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	size_t pending = 0;
+	for (auto& reply : replies) {
+		pending += reply.valid();
+	}
+	while (pending > 0) {
+		int first = -1;
+		for (size_t s = 0; s < clients.size(); s++) {
+			if (!replies[s].valid()) {
+				continue;
+			}
+			if (replies[s].wait_for(chrono::seconds(0)) != future_status::ready) {
+				first = first < 0 ? (int) s : first;
+				continue;
+			}
+			auto now = chrono::steady_clock::now();
+			try {
+				replies[s].get();
+				lock_guard<mutex> lock(mtx);
+				addRtt(links[s], chrono::duration<double, milli>(now - sent[s]).count());
+				answered[s] = true;
+			} catch (std::exception& e) {
+				replies[s] = future<RPCLIB_MSGPACK::object_handle>();
+			}
+			pending--;
+		}
+		if (first < 0) {
+			break;
+		}
+		{
+			lock_guard<mutex> lock(mtx);
+			if (stopping || chrono::steady_clock::now() > deadline) {
+				break;
+			}
+		}
+		replies[first].wait_for(POLL);
+	}
+	return answered;
+}
+
+void LinkEstimator::start(const vector<string>& hosts, const vector<int>& ports, uint64_t intervalMs, uint64_t timeoutMs)
+{
+	stop();
+	stopping = false;
+	prober = thread(&LinkEstimator::run, this, hosts, ports, intervalMs, timeoutMs);
+}
+
+void LinkEstimator::stop()
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		stopping = true;
+	}
+	wake.notify_all();
+	if (prober.joinable()) {
+		prober.join();
+	}
+}
+
+void LinkEstimator::run(vector<string> hosts, vector<int> ports, uint64_t intervalMs, uint64_t timeoutMs)
+{
+	// rpclib clients are not safe to call from two threads, and pings on
+	// the client's own connections would queue behind its transfers
+	vector<unique_ptr<rpc::client>> owned;
+	vector<rpc::client*> clients;
+	try {
+		for (size_t s = 0; s < hosts.size(); s++) {
+			owned.emplace_back(new rpc::client(hosts[s], ports[s]));
+			owned.back()->set_timeout(timeoutMs);
+			clients.push_back(owned.back().get());
+		}
+	} catch (std::exception& e) {
+		return; // estimates then come from the client's own calls
+	}
+
+	while (true) {
+		{
+			unique_lock<mutex> lock(mtx);
+			wake.wait_for(lock, chrono::milliseconds(intervalMs), [this] { return stopping; });
+			if (stopping) {
+				return;
+			}
+		}
+		ping(clients, timeoutMs, false);
+	}
+}
+
+//-----------------------------------------------------------------
+//------------------------ Call samples ---------------------------
+//-----------------------------------------------------------------
+
+void LinkEstimator::addRtt(Link& link, double ms)
+{
+	link.rtt = link.rtts.empty() ? ms : (1 - EWMA_WEIGHT) * link.rtt + EWMA_WEIGHT * ms;
+	if (link.rtts.size() < RTT_SAMPLES) {
+		link.rtts.push_back(ms);
+	} else {
+		link.rtts[link.nextRtt] = ms;
+	}
+	link.nextRtt = (link.nextRtt + 1) % RTT_SAMPLES;
+}
+
+void LinkEstimator::finished(int server, chrono::steady_clock::time_point issuedAt, size_t bytes)
+{
+	lock_guard<mutex> lock(mtx);
+	Link& link = links[server];
+
+	auto now = chrono::steady_clock::now();
+	double ms = chrono::duration<double, milli>(now - issuedAt).count();
+
+	// Calls to one server answer in turn, so a call issued while another
+	// was out only took the time since that one's reply
+	bool idle = issuedAt >= link.lastReply;
+	double busy = chrono::duration<double, milli>(now - (idle ? issuedAt : link.lastReply)).count();
+	link.lastReply = now;
+
+	// A small call on an idle link is a round trip; so is any call that
+	// came back faster than the round trip thought to be
+	if ((idle && bytes <= SMALL_CALL_BYTES) || ms < link.rtt) {
+		addRtt(link, ms);
+	}
+	if (bytes <= SMALL_CALL_BYTES) {
+		return;
+	}
+	double transfer = max(idle ? busy - link.rtt : busy, busy / 10);
+	double sample = bytes / max(transfer, 0.001);
+	link.bandwidth = link.bandwidth <= 0 ? sample : (1 - EWMA_WEIGHT) * link.bandwidth + EWMA_WEIGHT * sample;
+}
+
+//-----------------------------------------------------------------
+//-------------------------- Estimates ----------------------------
+//-----------------------------------------------------------------
+
+double LinkEstimator::rtt(int server) const
+{
+	lock_guard<mutex> lock(mtx);
+	return links[server].rtt;
+}
+
+double LinkEstimator::rttPercentile(int server, double p) const
+{
+	lock_guard<mutex> lock(mtx);
+	vector<double> sorted(links[server].rtts);
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t at = (size_t) ((sorted.size() - 1) * p / 100);
+	nth_element(sorted.begin(), sorted.begin() + at, sorted.end());
+	return sorted[at];
+}
+
+double LinkEstimator::bandwidth(int server) const
+{
+	lock_guard<mutex> lock(mtx);
+	return links[server].bandwidth;
+}
+
+double LinkEstimator::expected(int server, size_t bytes) const
+{
+	lock_guard<mutex> lock(mtx);
+	const Link& link = links[server];
+	double bandwidth = link.bandwidth;
+
+	if (bandwidth <= 0) {
+		for (auto& other : links) {
+			bandwidth = max(bandwidth, other.bandwidth);
+		}
+		if (bandwidth <= 0) {
+			bandwidth = DEFAULT_BANDWIDTH;
+		}
+	}
+	return link.rtt + bytes / bandwidth;
+}
+
+vector<int> LinkEstimator::order() const
+{
+	lock_guard<mutex> lock(mtx);
+	vector<int> servers(links.size());
+	for (size_t s = 0; s < servers.size(); s++) {
+		servers[s] = (int) s;
+	}
+	// Servers never heard from go last
+	stable_sort(servers.begin(), servers.end(), [this](int a, int b) {
+		if (links[a].rtts.empty() != links[b].rtts.empty()) {
+			return links[b].rtts.empty();
+		}
+		return links[a].rtt < links[b].rtt;
+	});
+	return servers;
+}
+
+int LinkEstimator::nearest(int except) const
+{
+	vector<int> servers = order();
+	for (int s : servers) {
+		if (s != except) {
+			return s;
+		}
+	}
+	return -1;
+}
+
+int LinkEstimator::farthest(int except) const
+{
+	vector<int> servers = order();
+	for (auto it = servers.rbegin(); it != servers.rend(); ++it) {
+		if (*it != except) {
+			return *it;
+		}
+	}
+	return -1;
+}
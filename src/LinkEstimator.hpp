@@ -0,0 +1,94 @@
+#ifndef LINKESTIMATOR_HPP
+#define LINKESTIMATOR_HPP
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rpc/client.h"
+
+using namespace std;
+
+// Round trip time and throughput of the link to each server, kept up to
+// date for as long as the client runs. probe() pings every server at
+// once, so a first estimate costs about one round trip. After that, calls
+// report how long they took through finished(): a small call is a round
+// trip sample, a large one a throughput sample. While started, a
+// background thread also pings every server every intervalMs over
+// connections of its own, so a server the client stopped using because
+// it was slow is noticed when it recovers.
+//
+// Round trips are kept as an EWMA for decisions, plus recent samples for
+// percentiles. Thread-safe.
+class LinkEstimator {
+public:
+	explicit LinkEstimator(size_t servers);
+	~LinkEstimator();
+
+	LinkEstimator(const LinkEstimator&) = delete;
+	LinkEstimator& operator=(const LinkEstimator&) = delete;
+
+	// Pings every server concurrently and waits up to timeoutMs for the
+	// replies; false for each server that did not answer
+	vector<bool> probe(const vector<rpc::client*>& clients, uint64_t timeoutMs);
+
+	// Background probing of the servers at hosts and ports
+	void start(const vector<string>& hosts, const vector<int>& ports, uint64_t intervalMs, uint64_t timeoutMs);
+	void stop();
+
+	// A call to server issued at issuedAt was answered, with bytes sent
+	// or received
+	void finished(int server, chrono::steady_clock::time_point issuedAt, size_t bytes);
+
+	// Milliseconds: smoothed, and the p-th percentile of recent samples
+	double rtt(int server) const;
+	double rttPercentile(int server, double p) const;
+	// Bytes per millisecond, 0 until measured
+	double bandwidth(int server) const;
+
+	// Milliseconds for server to move bytes. A server whose bandwidth was
+	// not measured is taken to be as fast as the fastest one, so it gets
+	// tried.
+	double expected(int server, size_t bytes) const;
+
+	// Servers by ascending round trip time
+	vector<int> order() const;
+	// Server with the shortest or longest round trip other than except,
+	// -1 if there is none
+	int nearest(int except = -1) const;
+	int farthest(int except = -1) const;
+
+	size_t size() const {
+		return links.size();
+	}
+
+protected:
+	struct Link {
+		double rtt;          // milliseconds, EWMA; 0 until sampled
+		vector<double> rtts; // recent samples
+		size_t nextRtt;
+		double bandwidth;    // bytes per millisecond; 0 until measured
+		chrono::steady_clock::time_point lastReply;
+	};
+
+	void addRtt(Link& link, double ms);
+	void run(vector<string> hosts, vector<int> ports, uint64_t intervalMs, uint64_t timeoutMs);
+
+	// Pings clients at once, taking what answers within timeoutMs unless
+	// stop() is called first. Unless connecting, clients not connected
+	// are skipped rather than waited for.
+	vector<bool> ping(const vector<rpc::client*>& clients, uint64_t timeoutMs, bool connecting);
+
+	mutable mutex mtx;
+	vector<Link> links;
+
+	thread prober;
+	bool stopping;
+	condition_variable wake;
+};
+
+#endif // LINKESTIMATOR_HPP
@@ -0,0 +1,75 @@
+#include <string.h>
+#include <algorithm>
+
+#include "LocalIndex.hpp"
+#include "Sha256.hpp"
+
+// Blocks hashed per hashMany call, so multi-buffer backends stay busy
+static const size_t HASH_BATCH = 64;
+
+LocalIndex::LocalIndex(size_t t_blocksize, const Chunker* t_chunker)
+	: blocksize(t_blocksize), chunker(t_chunker)
+{
+}
+
+bool LocalIndex::add(const string& path, const function<bool(const BlockDigest&)>& wanted, size_t& added)
+{
+	added = 0;
+
+	unique_ptr<MappedFile> file(new MappedFile);
+	if (!file->openReadOnly(path)) {
+		return false;
+	}
+	const unsigned char* data = (const unsigned char*) file->data();
+	size_t length = file->size();
+
+	// Cut points first, then hash them a batch at a time
+	vector<size_t> starts;
+	vector<size_t> lens;
+	for (size_t start = 0; start < length; ) {
+		size_t len = chunker ? chunker->nextChunk(data + start, length - start) : min(blocksize, length - start);
+		starts.push_back(start);
+		lens.push_back(len);
+		start += len;
+	}
+
+	vector<const unsigned char*> blocks(HASH_BATCH);
+	vector<uint8_t> digests(HASH_BATCH * Sha256::SIZE);
+	uint32_t number = files.size();
+
+	for (size_t first = 0; first < starts.size(); first += HASH_BATCH) {
+		size_t count = min(HASH_BATCH, starts.size() - first);
+		for (size_t i = 0; i < count; i++) {
+			blocks[i] = data + starts[first + i];
+		}
+		Sha256::hashMany(count, blocks.data(), &lens[first], digests.data());
+
+		for (size_t i = 0; i < count; i++) {
+			BlockDigest digest;
+			memcpy(digest.bytes, &digests[i * Sha256::SIZE], BlockDigest::SIZE);
+			if (!wanted(digest)) {
+				continue;
+			}
+			Ref ref = { number, (uint32_t) lens[first + i], starts[first + i] };
+			bool inserted;
+			if (refs.insert(digest, ref, inserted) != nullptr && inserted) {
+				added++;
+			}
+		}
+	}
+
+	if (added > 0) {
+		files.push_back(std::move(file));
+	}
+	return true;
+}
+
+bool LocalIndex::get(const BlockDigest& digest, string& block) const
+{
+	const Ref* ref = refs.find(digest);
+	if (ref == nullptr) {
+		return false;
+	}
+	block.assign(files[ref->file]->data() + ref->offset, ref->length);
+	return true;
+}
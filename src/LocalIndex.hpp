@@ -0,0 +1,49 @@
+#ifndef LOCALINDEX_HPP
+#define LOCALINDEX_HPP
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BlockDigest.hpp"
+#include "Chunker.hpp"
+#include "DigestTable.hpp"
+#include "MappedFile.hpp"
+
+using namespace std;
+
+// Blocks of files already on local disk, found by cutting each file the
+// way the uploader does (fixed blocksize blocks, or content-defined
+// chunks when chunker is set) and hashing the pieces. Files stay mapped
+// while the index lives, so their blocks can still be read after the
+// download replaces them. Not thread-safe.
+class LocalIndex {
+public:
+	LocalIndex(size_t t_blocksize, const Chunker* t_chunker);
+
+	// Maps path and indexes its blocks that wanted accepts; false if it
+	// cannot be read. Returns how many blocks were indexed in added.
+	bool add(const string& path, const function<bool(const BlockDigest&)>& wanted, size_t& added);
+
+	bool get(const BlockDigest& digest, string& block) const;
+	bool contains(const BlockDigest& digest) const {
+		return refs.find(digest) != nullptr;
+	}
+
+protected:
+	struct Ref {
+		uint32_t file;
+		uint32_t length;
+		uint64_t offset;
+	};
+
+	size_t blocksize;
+	const Chunker* chunker;
+
+	vector<unique_ptr<MappedFile>> files;
+	DigestTable<Ref> refs;
+};
+
+#endif // LOCALINDEX_HPP
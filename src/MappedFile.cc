@@ -0,0 +1,107 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utility>
+
+#include "MappedFile.hpp"
+
+MappedFile::MappedFile()
+	: fd(-1), base(nullptr), length(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::openReadOnly(const string& path)
+{
+	close();
+
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	if (!map(PROT_READ)) {
+		return false;
+	}
+	// Read-only maps are files being streamed front to back
+	if (base) {
+		madvise(base, length, MADV_SEQUENTIAL);
+	}
+	return true;
+}
+
+bool MappedFile::openReadWrite(const string& path, size_t minSize)
+{
+	close();
+
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close();
+		return false;
+	}
+	if ((size_t) st.st_size < minSize && ftruncate(fd, minSize) < 0) {
+		close();
+		return false;
+	}
+	return map(PROT_READ | PROT_WRITE);
+}
+
+bool MappedFile::map(int prot)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close();
+		return false;
+	}
+	length = st.st_size;
+
+	// mmap rejects empty ranges; an empty file maps to no data
+	if (length == 0) {
+		return true;
+	}
+
+	void* addr = mmap(nullptr, length, prot, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		close();
+		return false;
+	}
+	base = static_cast<char*>(addr);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (base != nullptr) {
+		munmap(base, length);
+		base = nullptr;
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+	length = 0;
+}
+
+bool MappedFile::sync()
+{
+	if (base != nullptr && msync(base, length, MS_SYNC) < 0) {
+		return false;
+	}
+	return fd >= 0 && fsync(fd) == 0;
+}
+
+void MappedFile::swap(MappedFile& other)
+{
+	std::swap(fd, other.fd);
+	std::swap(base, other.base);
+	std::swap(length, other.length);
+}
@@ -0,0 +1,47 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+
+using namespace std;
+
+// A file mapped into memory with mmap. Read-write mappings are shared, so
+// stores through data() land in the file itself.
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool openReadOnly(const string& path);
+
+	// Maps path read-write, creating it if needed and zero-extending it
+	// to at least minSize bytes
+	bool openReadWrite(const string& path, size_t minSize);
+
+	void close();
+	// Flushes a read-write mapping and the file to disk
+	bool sync();
+	void swap(MappedFile& other);
+
+	char* data() const {
+		return base;
+	}
+	size_t size() const {
+		return length;
+	}
+	bool isOpen() const {
+		return base != nullptr || fd >= 0;
+	}
+
+protected:
+	bool map(int prot);
+
+	int fd;
+	char* base;
+	size_t length;
+};
+
+#endif // MAPPEDFILE_HPP
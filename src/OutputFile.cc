@@ -0,0 +1,175 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "OutputFile.hpp"
+
+OutputFile::OutputFile()
+	: fd(-1), blocks(0), settled(0), broken(false), blockBytes(0), end(0), next(0), offset(0), heldBytes(0)
+{
+}
+
+OutputFile::~OutputFile()
+{
+	close();
+}
+
+bool OutputFile::open(const string& path, size_t t_blocks, uint64_t expected, uint64_t t_blockBytes)
+{
+	close();
+
+	// Written beside path and renamed over it on close, so a file being
+	// replaced stays intact, and readable through mappings, until then
+	temp = path + ".part";
+	fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	target = path;
+	blocks = t_blocks;
+	settled = 0;
+	broken = false;
+	blockBytes = t_blockBytes;
+	end = 0;
+	next = 0;
+	offset = 0;
+	written.assign(blockBytes ? blocks : 0, false);
+
+	// Only a hint: file systems without fallocate just grow the file
+	if (expected > 0) {
+		posix_fallocate(fd, 0, expected);
+	}
+	return true;
+}
+
+bool OutputFile::write(const string& block, uint64_t at)
+{
+	size_t done = 0;
+	while (done < block.size()) {
+		ssize_t n = pwrite(fd, block.data() + done, block.size() - done, at + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += n;
+	}
+	end = max(end, at + block.size());
+	settled++;
+	return true;
+}
+
+bool OutputFile::append(const string& block)
+{
+	if (!write(block, offset)) {
+		return false;
+	}
+	offset += block.size();
+	next++;
+	return true;
+}
+
+void OutputFile::lose()
+{
+	// Blocks held for an earlier one will never be written either
+	broken = true;
+	settled += 1 + waiting.size();
+	waiting.clear();
+	heldBytes = 0;
+}
+
+bool OutputFile::put(size_t index, string& block)
+{
+	if (fd < 0 || index >= blocks) {
+		return false;
+	}
+	if (broken) {
+		settled++;
+		return true;
+	}
+
+	if (blockBytes > 0) {
+		if (written[index]) {
+			return false;
+		}
+		written[index] = true;
+		// Only the last block may be short
+		if (block.size() > blockBytes || (index + 1 < blocks && block.size() != blockBytes)) {
+			errno = EINVAL;
+			lose();
+			return false;
+		}
+		if (!write(block, index * blockBytes)) {
+			lose();
+			return false;
+		}
+		return true;
+	}
+
+	if (index < next) {
+		return false;
+	}
+	if (index > next) {
+		heldBytes += block.size();
+		waiting[index].swap(block);
+		return true;
+	}
+	if (!append(block)) {
+		lose();
+		return false;
+	}
+	for (auto it = waiting.begin(); it != waiting.end() && it->first == next; it = waiting.erase(it)) {
+		heldBytes -= it->second.size();
+		if (!append(it->second)) {
+			waiting.erase(it);
+			lose();
+			return false;
+		}
+	}
+	return true;
+}
+
+void OutputFile::fail(size_t index)
+{
+	if (fd < 0 || index >= blocks) {
+		return;
+	}
+	if (broken) {
+		settled++;
+	} else if (blockBytes > 0) {
+		if (!written[index]) {
+			written[index] = true;
+			lose();
+		}
+	} else if (index >= next && !waiting.count(index)) {
+		lose();
+	}
+}
+
+bool OutputFile::close()
+{
+	if (fd < 0) {
+		return true;
+	}
+	// A file short of a block is dropped, leaving path as it was
+	if (broken || settled < blocks) {
+		::close(fd);
+		unlink(temp.c_str());
+		fd = -1;
+		broken = true;
+		waiting.clear();
+		heldBytes = 0;
+		return false;
+	}
+	// Drop the preallocated tail past what was written
+	bool ok = ftruncate(fd, end) == 0;
+	ok = ::close(fd) == 0 && ok;
+	ok = rename(temp.c_str(), target.c_str()) == 0 && ok;
+	fd = -1;
+	waiting.clear();
+	heldBytes = 0;
+	return ok;
+}
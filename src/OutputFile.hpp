@@ -0,0 +1,80 @@
+#ifndef OUTPUTFILE_HPP
+#define OUTPUTFILE_HPP
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A downloaded file, written as its blocks arrive in any order. Space
+// for the expected size is allocated up front. When every block but the
+// last is blockBytes long, each one is written with pwrite at its offset
+// as soon as it arrives. Otherwise, as for content-defined chunks, a
+// block is written once every block before it arrived, which fixes its
+// offset, and is held in memory until then. Blocks go to path.part;
+// close() trims it to the bytes written and renames it to path, unless
+// a block could not be got or written: then path.part is removed and
+// path left as it was.
+class OutputFile {
+public:
+	OutputFile();
+	~OutputFile();
+
+	OutputFile(const OutputFile&) = delete;
+	OutputFile& operator=(const OutputFile&) = delete;
+
+	// Creates or truncates path for blocks blocks of about expected bytes
+	// in all, of blockBytes each if that is known, 0 if not
+	bool open(const string& path, size_t t_blocks, uint64_t expected, uint64_t t_blockBytes = 0);
+
+	// Places block number index, taking its bytes; false on a write error
+	// or a fixed-size block of the wrong size, which fails the file
+	bool put(size_t index, string& block);
+
+	// Records that block number index could not be got, failing the file
+	void fail(size_t index);
+
+	// Every block was placed or given up on
+	bool complete() const {
+		return settled == blocks;
+	}
+	// A block was given up on; close() will drop the file
+	bool failed() const {
+		return broken;
+	}
+	// Bytes of blocks waiting for an earlier one
+	size_t held() const {
+		return heldBytes;
+	}
+
+	bool close();
+
+protected:
+	bool write(const string& block, uint64_t at);
+	// Writes the block of unknown offset that is next
+	bool append(const string& block);
+	// Gives the file up, settling the blocks held
+	void lose();
+
+	int fd;
+	string target;
+	string temp;
+	size_t blocks;
+	size_t settled; // blocks written or given up on
+	bool broken;
+	uint64_t blockBytes; // 0: offsets follow from the blocks before
+	uint64_t end;        // past the furthest byte written
+
+	// Blocks of unknown offset: the first not written yet, where it
+	// goes, and those that arrived before it
+	size_t next;
+	uint64_t offset;
+	map<size_t, string> waiting;
+	size_t heldBytes;
+
+	vector<bool> written; // fixed-size blocks already placed
+};
+
+#endif // OUTPUTFILE_HPP
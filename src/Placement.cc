@@ -0,0 +1,221 @@
+#include <stdint.h>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include "Placement.hpp"
+#include "ReedSolomon.hpp"
+
+//-----------------------------------------------------------------
+//-------------------------- Randomness ---------------------------
+//-----------------------------------------------------------------
+
+// xorshift64*: a few cycles a draw, and one generator per thread, so
+// hash workers and the upload loop never share or lock one
+static uint64_t nextRandom()
+{
+	static thread_local uint64_t state = 0;
+	if (state == 0) {
+		random_device device;
+		state = ((uint64_t) device() << 32 | device()) ^ hash<thread::id>()(this_thread::get_id());
+		state |= 1;
+	}
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+uint32_t Placement::random(uint32_t n)
+{
+	// Lemire's multiply-shift: no division, and unbiased enough for n
+	// far below 2^32
+	return (uint32_t) (((nextRandom() >> 32) * (uint64_t) n) >> 32);
+}
+
+//-----------------------------------------------------------------
+//-------------------- random and tworandom -----------------------
+//-----------------------------------------------------------------
+
+// N distinct servers drawn uniformly
+template <int N>
+class RandomPlacement : public Placement {
+public:
+	explicit RandomPlacement(int t_servers) : servers(t_servers) {}
+
+	int width() const {
+		return N;
+	}
+	bool anyServer() const {
+		return true;
+	}
+
+	void place(const BlockDigest*, size_t count, int* out) {
+		for (size_t i = 0; i < count; i++, out += N) {
+			for (int r = 0; r < N; r++) {
+				// Redraw a server already picked for this block
+				int s;
+				bool taken;
+				do {
+					s = (int) random(servers);
+					taken = false;
+					for (int q = 0; q < r; q++) {
+						taken |= out[q] == s;
+					}
+				} while (taken);
+				out[r] = s;
+			}
+		}
+	}
+
+protected:
+	uint32_t servers;
+};
+
+template <>
+void RandomPlacement<1>::place(const BlockDigest*, size_t count, int* out)
+{
+	for (size_t i = 0; i < count; i++) {
+		out[i] = (int) random(servers);
+	}
+}
+
+// The second server is drawn from the other servers-1 and shifted past
+// the first, so no draw is ever repeated
+template <>
+void RandomPlacement<2>::place(const BlockDigest*, size_t count, int* out)
+{
+	for (size_t i = 0; i < count; i++, out += 2) {
+		int first = (int) random(servers);
+		int second = (int) random(servers - 1);
+		out[0] = first;
+		out[1] = second + (second >= first);
+	}
+}
+
+//-----------------------------------------------------------------
+//------------ local, localclosest and localfarthest --------------
+//-----------------------------------------------------------------
+
+enum Nearness { LOCAL, CLOSEST, FARTHEST };
+
+// The lowest RTT server, alone or with the next closest or the farthest,
+// as the RTT order stands when the batch is placed
+template <Nearness M>
+class NearestPlacement : public Placement {
+public:
+	explicit NearestPlacement(const ServerOrder& t_order) : order(t_order) {}
+
+	int width() const {
+		return M == LOCAL ? 1 : 2;
+	}
+
+	void place(const BlockDigest*, size_t count, int* out) {
+		vector<int> servers = order();
+		int picks[2] = { servers.front(), M == CLOSEST ? servers[1] : servers.back() };
+		for (size_t i = 0; i < count; i++) {
+			for (int r = 0; r < (M == LOCAL ? 1 : 2); r++) {
+				*out++ = picks[r];
+			}
+		}
+	}
+
+protected:
+	ServerOrder order;
+};
+
+//-----------------------------------------------------------------
+//--------------------------- ec(k,m) -----------------------------
+//-----------------------------------------------------------------
+
+// Fragment i goes to the i-th server after a first one picked by the
+// hash, so an unchanged block lands where it did before
+class ErasurePlacement : public Placement {
+public:
+	ErasurePlacement(int t_fragments, int t_servers) : fragments(t_fragments), servers(t_servers) {}
+
+	int width() const {
+		return fragments;
+	}
+
+	void place(const BlockDigest* digests, size_t count, int* out) {
+		for (size_t i = 0; i < count; i++) {
+			const uint8_t* b = digests[i].bytes;
+			uint32_t prefix = (uint32_t) b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+			int first = (int) (prefix % servers);
+			for (int f = 0; f < fragments; f++) {
+				*out++ = (first + f) % servers;
+			}
+		}
+	}
+
+protected:
+	int fragments;
+	int servers;
+};
+
+//-----------------------------------------------------------------
+//---------------------------- ring(r) ----------------------------
+//-----------------------------------------------------------------
+
+class RingPlacement : public Placement {
+public:
+	RingPlacement(const HashRing& t_ring, int t_replicas) : ring(t_ring), replicas(t_replicas) {}
+
+	int width() const {
+		return replicas;
+	}
+
+	void place(const BlockDigest* digests, size_t count, int* out) {
+		for (size_t i = 0; i < count; i++) {
+			vector<int> chosen = ring.replicas(digests[i], replicas);
+			for (int s : chosen) {
+				*out++ = s;
+			}
+		}
+	}
+
+protected:
+	const HashRing& ring;
+	int replicas;
+};
+
+//-----------------------------------------------------------------
+//---------------------------- Factory ----------------------------
+//-----------------------------------------------------------------
+
+unique_ptr<Placement> Placement::create(const string& policy, int servers, const ServerOrder& order,
+                                        const HashRing* ring, string& error)
+{
+	unique_ptr<Placement> placement;
+	int k, m, r;
+
+	if (policy == "random") {
+		placement.reset(new RandomPlacement<1>(servers));
+	} else if (policy == "tworandom") {
+		placement.reset(new RandomPlacement<2>(servers));
+	} else if (policy == "local") {
+		placement.reset(new NearestPlacement<LOCAL>(order));
+	} else if (policy == "localclosest") {
+		placement.reset(new NearestPlacement<CLOSEST>(order));
+	} else if (policy == "localfarthest") {
+		placement.reset(new NearestPlacement<FARTHEST>(order));
+	} else if (ReedSolomon::parse(policy, k, m)) {
+		placement.reset(new ErasurePlacement(k + m, servers));
+	} else if (HashRing::parse(policy, r)) {
+		if (ring == nullptr || (int) ring->servers() != servers) {
+			error = "Policy " + policy + " needs a ring of the servers";
+			return nullptr;
+		}
+		placement.reset(new RingPlacement(*ring, r));
+	} else {
+		error = "Unknown placement policy " + policy;
+		return nullptr;
+	}
+
+	if (placement->width() > servers) {
+		error = "Policy " + policy + " needs " + to_string(placement->width()) + " servers";
+		return nullptr;
+	}
+	return placement;
+}
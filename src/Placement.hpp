@@ -0,0 +1,57 @@
+#ifndef PLACEMENT_HPP
+#define PLACEMENT_HPP
+
+#include <stddef.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BlockDigest.hpp"
+#include "HashRing.hpp"
+
+using namespace std;
+
+// Picks the servers each block is stored on under a placement policy.
+// Blocks are placed a batch at a time: a policy reads what it needs, such
+// as the servers' current RTT order, once per batch, and then fills in
+// the servers of every block in a tight loop.
+//
+// Policies, for any number of servers:
+//   random, tworandom         1 or 2 distinct servers drawn uniformly
+//   local                     the server with the lowest RTT
+//   localclosest              it and the next closest
+//   localfarthest             it and the farthest
+//   ec(k,m)                   k + m consecutive servers from one picked by the hash
+//   ring(r)                   r replicas on a consistent hashing ring
+class Placement {
+public:
+	// Servers in ascending RTT order, asked once per batch
+	typedef function<vector<int>()> ServerOrder;
+
+	virtual ~Placement() {}
+
+	// Servers each block goes to
+	virtual int width() const = 0;
+
+	// Writes width() distinct servers for each of count blocks to out;
+	// block i's start at out + i * width()
+	virtual void place(const BlockDigest* digests, size_t count, int* out) = 0;
+
+	// Policies that draw servers at random, for which any server already
+	// holding a block is as good as the ones drawn
+	virtual bool anyServer() const {
+		return false;
+	}
+
+	// The policy named policy over servers servers; ring is used by
+	// ring(r), which must be built for the same servers. nullptr, with
+	// error set, if policy is unknown or needs more servers.
+	static unique_ptr<Placement> create(const string& policy, int servers, const ServerOrder& order,
+	                                    const HashRing* ring, string& error);
+
+	// Uniform in [0, n), from a generator of the calling thread's own
+	static uint32_t random(uint32_t n);
+};
+
+#endif // PLACEMENT_HPP
@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+#include "ReedSolomon.hpp"
+#include "Sha256.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define REEDSOLOMON_X86
+#include <immintrin.h>
+#endif
+
+//-----------------------------------------------------------------
+//------------------------- GF(2^8) -------------------------------
+//-----------------------------------------------------------------
+
+// x^8 + x^4 + x^3 + x^2 + 1, with 2 as the generator
+static const unsigned POLYNOMIAL = 0x11d;
+
+struct GfTables {
+	uint8_t exp[512];
+	uint8_t log[256];
+	uint8_t mul[256][256];
+
+	GfTables() {
+		unsigned x = 1;
+		for (int i = 0; i < 255; ++i) {
+			exp[i] = (uint8_t) x;
+			exp[i + 255] = (uint8_t) x;
+			log[x] = (uint8_t) i;
+			x <<= 1;
+			if (x & 0x100) {
+				x ^= POLYNOMIAL;
+			}
+		}
+		exp[510] = exp[0];
+		exp[511] = exp[1];
+		log[0] = 0;
+
+		for (int a = 0; a < 256; ++a) {
+			for (int b = 0; b < 256; ++b) {
+				mul[a][b] = a == 0 || b == 0 ? 0 : exp[log[a] + log[b]];
+			}
+		}
+	}
+};
+
+static const GfTables& gf()
+{
+	static const GfTables tables;
+	return tables;
+}
+
+uint8_t ReedSolomon::mul(uint8_t a, uint8_t b)
+{
+	return gf().mul[a][b];
+}
+
+uint8_t ReedSolomon::inverse(uint8_t a)
+{
+	return a == 0 ? 0 : gf().exp[255 - gf().log[a]];
+}
+
+//-----------------------------------------------------------------
+//------------------------- Kernels -------------------------------
+//-----------------------------------------------------------------
+
+static void mulAddScalar(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len)
+{
+	const uint8_t* row = gf().mul[c];
+	for (size_t i = 0; i < len; ++i) {
+		dst[i] ^= row[src[i]];
+	}
+}
+
+#ifdef REEDSOLOMON_X86
+
+// c * x = c * (x & 15) ^ c * (x & 240), so two 16-entry tables indexed
+// by the nibbles of x give the product; pshufb looks up 16 bytes at once
+
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+static void nibbleTables(uint8_t c, uint8_t lo[16], uint8_t hi[16])
+{
+	const uint8_t* row = gf().mul[c];
+	for (int x = 0; x < 16; ++x) {
+		lo[x] = row[x];
+		hi[x] = row[x << 4];
+	}
+}
+
+SSSE3_TARGET static void mulAddSsse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len)
+{
+	uint8_t lo[16], hi[16];
+	nibbleTables(c, lo, hi);
+
+	__m128i tlo = _mm_loadu_si128((const __m128i*) lo);
+	__m128i thi = _mm_loadu_si128((const __m128i*) hi);
+	__m128i mask = _mm_set1_epi8(0x0f);
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (src + i));
+		__m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(x, mask));
+		__m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+		__m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+	}
+	mulAddScalar(dst + i, src + i, c, len - i);
+}
+
+AVX2_TARGET static void mulAddAvx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len)
+{
+	uint8_t lo[16], hi[16];
+	nibbleTables(c, lo, hi);
+
+	__m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) lo));
+	__m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) hi));
+	__m256i mask = _mm256_set1_epi8(0x0f);
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) (src + i));
+		__m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(x, mask));
+		__m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask));
+		__m256i d = _mm256_loadu_si256((const __m256i*) (dst + i));
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+	}
+	mulAddScalar(dst + i, src + i, c, len - i);
+}
+
+#endif // REEDSOLOMON_X86
+
+//-----------------------------------------------------------------
+//------------------------- Dispatch ------------------------------
+//-----------------------------------------------------------------
+
+bool ReedSolomon::supported(Backend backend)
+{
+	switch (backend) {
+#ifdef REEDSOLOMON_X86
+	case SSSE3:
+		return __builtin_cpu_supports("ssse3");
+	case AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	case SCALAR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void ReedSolomon::mulAdd(Backend backend, uint8_t* dst, const uint8_t* src, uint8_t c, size_t len)
+{
+	if (c == 0) {
+		return;
+	}
+	switch (backend) {
+#ifdef REEDSOLOMON_X86
+	case SSSE3:
+		mulAddSsse3(dst, src, c, len);
+		return;
+	case AVX2:
+		mulAddAvx2(dst, src, c, len);
+		return;
+#endif
+	default:
+		mulAddScalar(dst, src, c, len);
+	}
+}
+
+bool ReedSolomon::selfTest(Backend backend)
+{
+	if (!supported(backend)) {
+		return false;
+	}
+
+	// Lengths around the vector widths, from unaligned starts
+	uint8_t src[200];
+	uint32_t seed = 2463534242u;
+	for (auto& b : src) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		b = (uint8_t) seed;
+	}
+
+	for (int c = 0; c < 256; ++c) {
+		for (size_t len : { 0, 1, 15, 16, 17, 31, 32, 33, 64, 127, 190 }) {
+			uint8_t expected[200];
+			uint8_t got[200];
+			memcpy(expected, src + 5, sizeof(expected) - 5);
+			memcpy(got, src + 5, sizeof(got) - 5);
+
+			mulAddScalar(expected + 1, src + 3, (uint8_t) c, len);
+			mulAdd(backend, got + 1, src + 3, (uint8_t) c, len);
+			if (memcmp(expected, got, sizeof(expected) - 5) != 0) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static ReedSolomon::Backend detect()
+{
+	if (ReedSolomon::selfTest(ReedSolomon::AVX2)) {
+		return ReedSolomon::AVX2;
+	}
+	if (ReedSolomon::selfTest(ReedSolomon::SSSE3)) {
+		return ReedSolomon::SSSE3;
+	}
+	return ReedSolomon::SCALAR;
+}
+
+ReedSolomon::Backend ReedSolomon::backend()
+{
+	static const Backend best = detect();
+	return best;
+}
+
+void ReedSolomon::mulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len)
+{
+	mulAdd(backend(), dst, src, c, len);
+}
+
+const char* ReedSolomon::name(Backend backend)
+{
+	switch (backend) {
+	case SSSE3:
+		return "ssse3";
+	case AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+//-----------------------------------------------------------------
+//------------------------- Code ----------------------------------
+//-----------------------------------------------------------------
+
+ReedSolomon::ReedSolomon(int t_k, int t_m)
+	: k(t_k), m(t_m), parity(t_m * t_k)
+{
+	// Cauchy matrix 1 / (x_i + y_j) with x_i = k + i and y_j = j: every
+	// x_i differs from every y_j, and any square submatrix of it, or of
+	// it stacked under the identity, is invertible
+	for (int i = 0; i < m; ++i) {
+		for (int j = 0; j < k; ++j) {
+			parity[i * k + j] = inverse((uint8_t) ((k + i) ^ j));
+		}
+	}
+}
+
+bool ReedSolomon::parse(const string& policy, int& k, int& m)
+{
+	int used = 0;
+	if (sscanf(policy.c_str(), "ec(%d,%d)%n", &k, &m, &used) != 2 || used != (int) policy.size()) {
+		return false;
+	}
+	return k >= 1 && m >= 1 && k + m <= MAX_FRAGMENTS;
+}
+
+string ReedSolomon::name() const
+{
+	return "ec(" + to_string(k) + "," + to_string(m) + ")";
+}
+
+uint8_t ReedSolomon::coefficient(int row, int col) const
+{
+	if (row < k) {
+		return row == col ? 1 : 0;
+	}
+	return parity[(row - k) * k + col];
+}
+
+string ReedSolomon::fragmentHash(const string& hash, int index) const
+{
+	string key = hash + "/" + name() + "/" + to_string(index);
+	return Sha256::hashHex(key.data(), key.size());
+}
+
+vector<string> ReedSolomon::encode(const char* data, size_t len) const
+{
+	size_t size = (len + k - 1) / k;
+	vector<string> out(k + m, string(HEADER + size, '\0'));
+
+	for (int f = 0; f < k + m; ++f) {
+		for (size_t b = 0; b < HEADER; ++b) {
+			out[f][b] = (char) (len >> (8 * b));
+		}
+	}
+	for (int j = 0; j < k; ++j) {
+		size_t start = min(len, j * size);
+		memcpy(&out[j][HEADER], data + start, min(size, len - start));
+	}
+	for (int i = 0; i < m; ++i) {
+		uint8_t* dst = (uint8_t*) &out[k + i][HEADER];
+		for (int j = 0; j < k; ++j) {
+			mulAdd(dst, (const uint8_t*) &out[j][HEADER], parity[i * k + j], size);
+		}
+	}
+	return out;
+}
+
+// Inverts the n x n matrix a in place by Gauss-Jordan elimination; false
+// if it is singular
+static bool invert(vector<uint8_t>& a, int n)
+{
+	vector<uint8_t> inv(n * n, 0);
+	for (int i = 0; i < n; ++i) {
+		inv[i * n + i] = 1;
+	}
+
+	for (int col = 0; col < n; ++col) {
+		int pivot = col;
+		while (pivot < n && a[pivot * n + col] == 0) {
+			pivot++;
+		}
+		if (pivot == n) {
+			return false;
+		}
+		if (pivot != col) {
+			for (int c = 0; c < n; ++c) {
+				swap(a[pivot * n + c], a[col * n + c]);
+				swap(inv[pivot * n + c], inv[col * n + c]);
+			}
+		}
+
+		uint8_t scale = ReedSolomon::inverse(a[col * n + col]);
+		for (int c = 0; c < n; ++c) {
+			a[col * n + c] = ReedSolomon::mul(a[col * n + c], scale);
+			inv[col * n + c] = ReedSolomon::mul(inv[col * n + c], scale);
+		}
+
+		for (int r = 0; r < n; ++r) {
+			uint8_t factor = a[r * n + col];
+			if (r == col || factor == 0) {
+				continue;
+			}
+			for (int c = 0; c < n; ++c) {
+				a[r * n + c] ^= ReedSolomon::mul(factor, a[col * n + c]);
+				inv[r * n + c] ^= ReedSolomon::mul(factor, inv[col * n + c]);
+			}
+		}
+	}
+	a.swap(inv);
+	return true;
+}
+
+bool ReedSolomon::decode(const vector<int>& indexes, const vector<const string*>& fragments, string& block) const
+{
+	if ((int) indexes.size() < k || indexes.size() != fragments.size() || fragments[0]->size() < HEADER) {
+		return false;
+	}
+
+	size_t total = fragments[0]->size();
+	size_t size = total - HEADER;
+	size_t len = 0;
+	for (size_t b = 0; b < HEADER; ++b) {
+		len |= (size_t) (unsigned char) (*fragments[0])[b] << (8 * b);
+	}
+	if ((len + k - 1) / k != size) {
+		return false;
+	}
+
+	// The first k fragments are used; data fragment j is present when
+	// source[j] is set
+	vector<const uint8_t*> source(k, nullptr);
+	vector<bool> seen(k + m, false);
+	for (int r = 0; r < k; ++r) {
+		int index = indexes[r];
+		if (index < 0 || index >= k + m || seen[index] || fragments[r]->size() != total
+			|| fragments[r]->compare(0, HEADER, *fragments[0], 0, HEADER) != 0) {
+			return false;
+		}
+		seen[index] = true;
+		if (index < k) {
+			source[index] = (const uint8_t*) fragments[r]->data() + HEADER;
+		}
+	}
+
+	block.assign(k * size, '\0');
+	uint8_t* out = (uint8_t*) &block[0];
+
+	bool missing = false;
+	for (int j = 0; j < k; ++j) {
+		if (source[j] != nullptr) {
+			memcpy(out + j * size, source[j], size);
+		} else {
+			missing = true;
+		}
+	}
+
+	// Data fragment j is row j of the inverse of the rows of the
+	// generator the fragments came from, applied to the fragments
+	if (missing) {
+		vector<uint8_t> rows(k * k);
+		for (int r = 0; r < k; ++r) {
+			for (int c = 0; c < k; ++c) {
+				rows[r * k + c] = coefficient(indexes[r], c);
+			}
+		}
+		if (!invert(rows, k)) {
+			return false;
+		}
+		for (int j = 0; j < k; ++j) {
+			if (source[j] != nullptr) {
+				continue;
+			}
+			for (int r = 0; r < k; ++r) {
+				mulAdd(out + j * size, (const uint8_t*) fragments[r]->data() + HEADER, rows[j * k + r], size);
+			}
+		}
+	}
+
+	block.resize(len);
+	return true;
+}
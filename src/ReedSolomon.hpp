@@ -0,0 +1,80 @@
+#ifndef REEDSOLOMON_HPP
+#define REEDSOLOMON_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Systematic Reed-Solomon erasure code over GF(2^8), for the ec(k,m)
+// placement policy. A block is cut into k data fragments and m parity
+// fragments are computed from them with a Cauchy matrix, so any k of
+// the k + m fragments rebuild the block.
+//
+// Every fragment starts with the block's length (HEADER bytes, little
+// endian), then size bytes, where size = ceil(length / k); the last data
+// fragment is padded with zeros.
+class ReedSolomon {
+public:
+	static const size_t HEADER = 4;
+	static const int MAX_FRAGMENTS = 256;
+
+	// Backends of the multiply-accumulate kernel, chosen on first use
+	enum Backend {
+		SCALAR, // one table lookup per byte
+		SSSE3,  // 16 bytes per step, split nibble tables with pshufb
+		AVX2    // 32 bytes per step
+	};
+
+	ReedSolomon(int t_k, int t_m);
+
+	// Parses a policy of the form ec(k,m); false if it is not one or the
+	// counts are out of range
+	static bool parse(const string& policy, int& k, int& m);
+	// The policy name, ec(k,m)
+	string name() const;
+
+	int dataFragments() const {
+		return k;
+	}
+	int fragments() const {
+		return k + m;
+	}
+
+	// The k + m fragments of len bytes at data
+	vector<string> encode(const char* data, size_t len) const;
+
+	// Rebuilds a block from k distinct fragments, fragments[i] being
+	// fragment number indexes[i]; false if they are too few, malformed or
+	// do not agree with each other
+	bool decode(const vector<int>& indexes, const vector<const string*>& fragments, string& block) const;
+
+	// Hex hash a fragment of the block with hex hash hash is stored under
+	string fragmentHash(const string& hash, int index) const;
+
+	// dst[i] ^= c * src[i] in GF(2^8) for len bytes
+	static void mulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
+	static void mulAdd(Backend backend, uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
+
+	static uint8_t mul(uint8_t a, uint8_t b);
+	static uint8_t inverse(uint8_t a);
+
+	static Backend backend();
+	static const char* name(Backend backend);
+	static bool supported(Backend backend);
+	// Checks the backend against SCALAR for every coefficient
+	static bool selfTest(Backend backend);
+
+protected:
+	// Entry (row, col) of the (k + m) x k generator matrix: identity
+	// rows for the data fragments, then the Cauchy rows for parity
+	uint8_t coefficient(int row, int col) const;
+
+	int k;
+	int m;
+	vector<uint8_t> parity; // m x k
+};
+
+#endif // REEDSOLOMON_HPP
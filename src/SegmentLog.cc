@@ -0,0 +1,193 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <algorithm>
+
+#include "SegmentLog.hpp"
+
+SegmentLog::SegmentLog()
+	: segmentBytes(0), first(0), tailOffset(0), liveBytes(0)
+{
+}
+
+SegmentLog::~SegmentLog()
+{
+	close();
+}
+
+string SegmentLog::segmentPath(uint32_t segment) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "-%06u.seg", segment);
+	return prefix + name;
+}
+
+bool SegmentLog::open(const string& t_prefix, uint64_t t_segmentBytes)
+{
+	close();
+	prefix = t_prefix;
+	segmentBytes = t_segmentBytes;
+
+	// Segments are numbered densely from the oldest one kept, so find
+	// that, then stop at the first missing one after it
+	first = 0;
+	for (uint32_t segment = firstSegment(); ; ++segment) {
+		int fd = ::open(segmentPath(segment).c_str(), O_RDWR);
+		if (fd < 0) {
+			if (errno != ENOENT) {
+				return false;
+			}
+			break;
+		}
+		if (fds.empty()) {
+			first = segment;
+			fds.assign(segment, -1);
+			sizes.assign(segment, 0);
+		}
+		fds.push_back(fd);
+
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			return false;
+		}
+		sizes.push_back(st.st_size);
+		liveBytes += st.st_size;
+		tailOffset = st.st_size;
+	}
+
+	if (fds.empty()) {
+		return startSegment();
+	}
+	return true;
+}
+
+uint32_t SegmentLog::firstSegment() const
+{
+	size_t slash = prefix.rfind('/');
+	string dir = slash == string::npos ? "." : prefix.substr(0, slash);
+	string base = prefix.substr(slash == string::npos ? 0 : slash + 1) + "-";
+
+	DIR* d = opendir(dir.c_str());
+	if (d == nullptr) {
+		return 0;
+	}
+	uint32_t lowest = UINT32_MAX;
+	while (struct dirent* entry = readdir(d)) {
+		unsigned segment;
+		char tail[8];
+		if (strncmp(entry->d_name, base.c_str(), base.size()) == 0
+			&& sscanf(entry->d_name + base.size(), "%u%7s", &segment, tail) == 2
+			&& strcmp(tail, ".seg") == 0 && segment < lowest) {
+			lowest = segment;
+		}
+	}
+	closedir(d);
+	return lowest == UINT32_MAX ? 0 : lowest;
+}
+
+bool SegmentLog::dropOldest()
+{
+	if (first + 1 >= fds.size()) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fds[first], &st) == 0) {
+		liveBytes -= min((uint64_t) st.st_size, liveBytes);
+	}
+	::close(fds[first]);
+	fds[first] = -1;
+	sizes[first] = 0;
+	return unlink(segmentPath(first++).c_str()) == 0;
+}
+
+void SegmentLog::close()
+{
+	for (int fd : fds) {
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+	fds.clear();
+	sizes.clear();
+	first = 0;
+	tailOffset = 0;
+	liveBytes = 0;
+}
+
+bool SegmentLog::startSegment()
+{
+	int fd = ::open(segmentPath(fds.size()).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	fds.push_back(fd);
+	sizes.push_back(0);
+	tailOffset = 0;
+	return true;
+}
+
+bool SegmentLog::append(const string& data, BlockLocation& location)
+{
+	if (tailOffset > 0 && tailOffset + data.size() > segmentBytes && !startSegment()) {
+		return false;
+	}
+
+	const char* p = data.data();
+	size_t remaining = data.size();
+	uint64_t offset = tailOffset;
+
+	while (remaining > 0) {
+		ssize_t n = pwrite(fds.back(), p, remaining, offset);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		offset += n;
+		remaining -= n;
+	}
+
+	location.segment = fds.size() - 1;
+	location.length = data.size();
+	location.place = 0;
+	location.setOffset(tailOffset);
+	liveBytes += offset - tailOffset;
+	tailOffset = offset;
+	sizes.back() = offset;
+	return true;
+}
+
+bool SegmentLog::read(const BlockLocation& location, string& data) const
+{
+	if (location.segment >= fds.size() || fds[location.segment] < 0) {
+		return false;
+	}
+
+	data.resize(location.length);
+	size_t done = 0;
+
+	while (done < location.length) {
+		ssize_t n = pread(fds[location.segment], &data[done], location.length - done,
+			location.offset() + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+bool SegmentLog::holds(const BlockLocation& location) const
+{
+	return location.segment < fds.size() && fds[location.segment] >= 0
+		&& location.offset() + location.length <= sizes[location.segment];
+}
@@ -0,0 +1,88 @@
+#ifndef SEGMENTLOG_HPP
+#define SEGMENTLOG_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Where a block's bytes live: a segment number plus a byte range in it.
+// The top byte of the offset word holds the codec the bytes are stored
+// with, so indexes written before blocks were compressed read back as
+// raw (codec 0). Indexes hold these as raw bytes, so the word is packed
+// by hand rather than with bitfields, whose layout is up to the compiler.
+struct BlockLocation {
+	static const int CODEC_SHIFT = 56;
+	static const uint64_t OFFSET_MASK = ((uint64_t) 1 << CODEC_SHIFT) - 1;
+
+	uint32_t segment;
+	uint32_t length;
+	uint64_t place; // offset | codec << CODEC_SHIFT
+
+	uint64_t offset() const {
+		return place & OFFSET_MASK;
+	}
+	int codec() const {
+		return (int) (place >> CODEC_SHIFT);
+	}
+	void setOffset(uint64_t offset) {
+		place = (place & ~OFFSET_MASK) | (offset & OFFSET_MASK);
+	}
+	void setCodec(int codec) {
+		place = (place & OFFSET_MASK) | (uint64_t) (uint8_t) codec << CODEC_SHIFT;
+	}
+};
+static_assert(sizeof(BlockLocation) == 16, "BlockLocation is stored on disk as 16 bytes");
+
+// Append-only block data split across numbered segment files
+// <prefix>-000000.seg, <prefix>-000001.seg, ... A new segment is started
+// once the current one reaches the size limit. The oldest segments can
+// be dropped, as a cache evicts; reads from them then fail. Not
+// thread-safe.
+class SegmentLog {
+public:
+	SegmentLog();
+	~SegmentLog();
+
+	SegmentLog(const SegmentLog&) = delete;
+	SegmentLog& operator=(const SegmentLog&) = delete;
+
+	// Opens every existing segment for prefix, appending to the last one
+	bool open(const string& t_prefix, uint64_t t_segmentBytes);
+	void close();
+
+	bool append(const string& data, BlockLocation& location);
+	bool read(const BlockLocation& location, string& data) const;
+	// Whether location lies wholly inside a segment still on disk. An
+	// index entry written before a crash can point past a segment's end.
+	bool holds(const BlockLocation& location) const;
+
+	// Deletes the oldest segment; never the one taking appends
+	bool dropOldest();
+
+	// First segment not dropped, and bytes in all of them
+	uint32_t oldest() const {
+		return first;
+	}
+	uint64_t bytes() const {
+		return liveBytes;
+	}
+
+protected:
+	string segmentPath(uint32_t segment) const;
+	// Lowest segment number on disk, 0 if there is none
+	uint32_t firstSegment() const;
+	bool startSegment();
+
+	string prefix;
+	uint64_t segmentBytes;
+
+	vector<int> fds;       // one per segment, -1 once dropped; the last one takes appends
+	vector<uint64_t> sizes; // bytes in each segment
+	uint32_t first;        // segments before it were dropped
+	uint64_t tailOffset;   // bytes already in the last segment
+	uint64_t liveBytes;
+};
+
+#endif // SEGMENTLOG_HPP
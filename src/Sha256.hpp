@@ -0,0 +1,54 @@
+#ifndef SHA256_HPP
+#define SHA256_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// SHA-256 with runtime CPU dispatch. The backend is chosen on first use:
+// SHA-NI when the CPU has it, else AVX2 multi-buffer (eight messages per
+// pass through hashMany), else picosha2. A backend is only used once it
+// has passed the known-answer self test.
+class Sha256 {
+public:
+	static const size_t SIZE = 32;
+
+	enum Backend {
+		SCALAR, // picosha2
+		SHANI,  // x86 SHA extensions, one message at a time
+		AVX2    // eight messages side by side; single messages go to SCALAR
+	};
+
+	// Writes the SIZE byte digest of len bytes at data to out
+	static void hash(const void* data, size_t len, uint8_t* out);
+
+	// Hashes count messages, writing digest i to out + i * SIZE. Lets the
+	// multi-buffer backend fill all its lanes.
+	static void hashMany(size_t count, const unsigned char* const* data, const size_t* lens, uint8_t* out);
+
+	// Lowercase hex of a SIZE byte digest
+	static string hex(const uint8_t* digest);
+	static string hashHex(const void* data, size_t len);
+
+	static Backend backend();
+	static const char* name(Backend backend);
+	static bool parse(const string& name, Backend& backend);
+
+	// Whether this CPU can run the backend
+	static bool supported(Backend backend);
+
+	// Known answers plus a cross-check against SCALAR on messages of
+	// every length up to a few blocks
+	static bool selfTest(Backend backend);
+
+	// Switches to the backend; false, leaving the current one, if it is
+	// unsupported or fails the self test
+	static bool use(Backend backend);
+
+	// Direct entry points, for the self test and the benchmark
+	static void hashMany(Backend backend, size_t count, const unsigned char* const* data, const size_t* lens, uint8_t* out);
+};
+
+#endif // SHA256_HPP
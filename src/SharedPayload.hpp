@@ -0,0 +1,148 @@
+#ifndef SHAREDPAYLOAD_HPP
+#define SHAREDPAYLOAD_HPP
+
+#include <memory>
+#include <string>
+
+#include "rpc/msgpack.hpp"
+
+#include "BlockView.hpp"
+
+using namespace std;
+
+// RPC arguments encoded once and shared by the requests to every server.
+// rpclib gives each request its own id, so the requests themselves can
+// not be shared; what is shared is everything below the envelope, which
+// each request copies in as it is instead of encoding it again.
+
+// A value packed to msgpack once
+class PackedValue {
+public:
+	template <typename T>
+	explicit PackedValue(const T& value) {
+		RPCLIB_MSGPACK::pack(buffer, value);
+	}
+
+	const char* data() const {
+		return buffer.data();
+	}
+	size_t size() const {
+		return buffer.size();
+	}
+
+protected:
+	RPCLIB_MSGPACK::sbuffer buffer;
+};
+
+// One store_blocks entry, [hash, bytes], or one store_coded_blocks
+// entry, [hash, codec byte + payload]. Everything up to the block's
+// bytes is encoded up front; the bytes are copied into each request
+// straight from the file mapping, or from the compressed copy.
+class PackedBlock {
+public:
+	PackedBlock(const string& t_hash, const BlockView& t_block)
+		: hashhex(t_hash), ownerhex(t_hash), view(t_block)
+	{
+		pack(string());
+	}
+
+	// Coded entry; an empty payload sends the block raw
+	PackedBlock(const string& t_hash, const BlockView& t_block, int codec, string t_payload)
+		: hashhex(t_hash), ownerhex(t_hash), view(t_block), payload(std::move(t_payload))
+	{
+		pack(string(1, (char) codec));
+	}
+
+	// A piece of block t_owner whose bytes are held here, such as an
+	// erasure-coded fragment. Packed for store_coded_blocks with codec,
+	// or for store_blocks when codec is negative.
+	PackedBlock(const string& t_hash, const string& t_owner, int codec, string t_bytes)
+		: hashhex(t_hash), ownerhex(t_owner), payload(std::move(t_bytes))
+	{
+		pack(codec < 0 ? string() : string(1, (char) codec));
+	}
+
+	const string& hash() const {
+		return hashhex;
+	}
+	// The block this entry stores, whole or in part; replica writes are
+	// counted against it
+	const string& owner() const {
+		return ownerhex;
+	}
+	const string& head() const {
+		return prefix;
+	}
+	// The block's bytes as sent: compressed or straight from the file
+	const char* body() const {
+		return payload.empty() ? view.data() : payload.data();
+	}
+	size_t bodySize() const {
+		return payload.empty() ? view.size() : payload.size();
+	}
+
+	// Bytes this entry adds to a request
+	size_t size() const {
+		return prefix.size() + bodySize();
+	}
+
+protected:
+	// Packs the array header, hash and string header, with tag as the
+	// first bytes of the string
+	void pack(const string& tag) {
+		RPCLIB_MSGPACK::sbuffer buffer;
+		RPCLIB_MSGPACK::packer<RPCLIB_MSGPACK::sbuffer> packer(buffer);
+		packer.pack_array(2);
+		packer.pack(hashhex);
+		packer.pack_str((uint32_t) (tag.size() + bodySize()));
+		prefix.assign(buffer.data(), buffer.size());
+		prefix += tag;
+	}
+
+	string hashhex;
+	string ownerhex;
+	BlockView view;
+	string payload; // compressed block, if any
+	string prefix;  // packed array header, hash, string header and tag
+};
+
+typedef shared_ptr<const PackedBlock> PackedBlockPtr;
+
+namespace RPCLIB_MSGPACK {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+// Shared values pack as what they point to, so handing one to async_call,
+// which copies its arguments, only copies the pointer
+template <typename T>
+struct pack<shared_ptr<const T>> {
+	template <typename Stream>
+	packer<Stream>& operator()(packer<Stream>& o, const shared_ptr<const T>& v) const {
+		return o.pack(*v);
+	}
+};
+
+// pack_str_body appends bytes as they are, which splices in the
+// pre-encoded parts
+template <>
+struct pack<PackedValue> {
+	template <typename Stream>
+	packer<Stream>& operator()(packer<Stream>& o, const PackedValue& v) const {
+		return o.pack_str_body(v.data(), (uint32_t) v.size());
+	}
+};
+
+template <>
+struct pack<PackedBlock> {
+	template <typename Stream>
+	packer<Stream>& operator()(packer<Stream>& o, const PackedBlock& v) const {
+		o.pack_str_body(v.head().data(), (uint32_t) v.head().size());
+		return o.pack_str_body(v.body(), (uint32_t) v.bodySize());
+	}
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE
+} // namespace RPCLIB_MSGPACK
+
+#endif // SHAREDPAYLOAD_HPP
@@ -0,0 +1,229 @@
+#include <algorithm>
+
+#include "StoreWindow.hpp"
+#include "logger.hpp"
+
+#include "rpc/rpc_error.h"
+
+//-----------------------------------------------------------------
+//------------------------- ReplicaAcks ---------------------------
+//-----------------------------------------------------------------
+
+ReplicaAcks::ReplicaAcks(int t_quorum)
+	: quorum(t_quorum > 0 ? t_quorum : 0), unsettled(0)
+{
+}
+
+int ReplicaAcks::needed(const Entry& e) const
+{
+	int want = quorum == 0 ? e.expected : max(quorum, (int) e.least);
+	return min(want, (int) e.expected);
+}
+
+bool ReplicaAcks::settled(const Entry& e) const
+{
+	return e.acked >= needed(e) || e.expected - e.failed < needed(e);
+}
+
+bool ReplicaAcks::expect(const string& hash, int server, int least)
+{
+	lock_guard<mutex> lock(mtx);
+	Entry& e = blocks[hash];
+	e.least = (uint16_t) least;
+
+	for (int s : e.servers) {
+		if (s == server) {
+			return false;
+		}
+	}
+	bool was = e.servers.empty() || settled(e);
+	e.servers.push_back(server);
+	e.expected++;
+	if (was && !settled(e)) {
+		unsettled++;
+	}
+	return true;
+}
+
+void ReplicaAcks::ack(const string& hash)
+{
+	lock_guard<mutex> lock(mtx);
+	Entry& e = blocks[hash];
+
+	bool was = settled(e);
+	e.acked++;
+	if (!was && settled(e)) {
+		unsettled--;
+		changed.notify_all();
+	}
+}
+
+void ReplicaAcks::fail(const string& hash)
+{
+	lock_guard<mutex> lock(mtx);
+	Entry& e = blocks[hash];
+
+	bool was = settled(e);
+	e.failed++;
+	if (!was && settled(e)) {
+		unsettled--;
+		changed.notify_all();
+	}
+}
+
+size_t ReplicaAcks::wait()
+{
+	unique_lock<mutex> lock(mtx);
+	changed.wait(lock, [this] { return unsettled == 0; });
+
+	size_t failed = 0;
+	for (auto& entry : blocks) {
+		if (entry.second.acked < needed(entry.second)) {
+			failed++;
+		}
+	}
+	return failed;
+}
+
+//-----------------------------------------------------------------
+//------------------------- StoreWindow ---------------------------
+//-----------------------------------------------------------------
+
+StoreWindow::StoreWindow(rpc::client* t_client, int t_server, const string& t_method, size_t t_window,
+                         int t_retries, uint64_t t_timeoutMs, ReplicaAcks& t_acks, LinkEstimator& t_links)
+	: client(t_client), server(t_server), method(t_method), window(t_window > 0 ? t_window : 1),
+	  retries(t_retries > 0 ? t_retries : 0), timeoutMs(t_timeoutMs), acks(t_acks), links(t_links),
+	  queued(window), sending(true)
+{
+	sender = thread([this]() { run(); });
+	reaper = thread([this]() { reap(); });
+}
+
+StoreWindow::~StoreWindow()
+{
+	drain();
+}
+
+void StoreWindow::send(BlockBatch batch)
+{
+	if (!batch.empty()) {
+		queued.push(std::move(batch));
+	}
+}
+
+void StoreWindow::drain()
+{
+	queued.close();
+	if (sender.joinable()) {
+		sender.join();
+	}
+	if (reaper.joinable()) {
+		reaper.join();
+	}
+}
+
+void StoreWindow::run()
+{
+	BlockBatch batch;
+
+	while (queued.pop(batch)) {
+		{
+			unique_lock<mutex> lock(mtx);
+			changed.wait(lock, [this] { return inflight.size() < window; });
+		}
+
+		// Only this thread adds calls, so the room is still there
+		Call call;
+		call.batch = make_shared<const BlockBatch>(std::move(batch));
+		call.attempts = 0;
+		issue(call);
+
+		lock_guard<mutex> lock(mtx);
+		inflight.push_back(std::move(call));
+		changed.notify_all();
+	}
+
+	lock_guard<mutex> lock(mtx);
+	sending = false;
+	changed.notify_all();
+}
+
+void StoreWindow::reap()
+{
+	unique_lock<mutex> lock(mtx);
+
+	while (true) {
+		changed.wait(lock, [this] { return !inflight.empty() || !sending; });
+		if (inflight.empty()) {
+			return;
+		}
+		Call& call = inflight.front();
+
+		lock.unlock();
+		bool done = complete(call);
+		lock.lock();
+
+		if (done) {
+			inflight.pop_front();
+			changed.notify_all();
+		}
+	}
+}
+
+void StoreWindow::issue(Call& call)
+{
+	lock_guard<mutex> lock(calling);
+	call.attempts++;
+	call.issued = chrono::steady_clock::now();
+	try {
+		call.result = client->async_call(method, call.batch);
+	} catch (std::exception&) {
+		// Not connected in time; the failure is handled like a reply's
+		promise<RPCLIB_MSGPACK::object_handle> failed;
+		failed.set_exception(current_exception());
+		call.result = failed.get_future();
+	}
+}
+
+bool StoreWindow::complete(Call& call)
+{
+	auto log = logger();
+
+	// A dropped connection never answers; do not wait out the timeout.
+	// One still being set up may answer once it is.
+	rpc::client::connection_state state = client->get_connection_state();
+	bool connected = state == rpc::client::connection_state::connected;
+	bool connecting = state == rpc::client::connection_state::initial;
+	auto due = call.issued + chrono::milliseconds(timeoutMs);
+
+	string error;
+	try {
+		if (call.result.wait_until(connected || connecting ? due : call.issued) == future_status::ready) {
+			call.result.get();
+			size_t bytes = 0;
+			for (auto& block : *call.batch) {
+				acks.ack(block->owner());
+				bytes += block->size();
+			}
+			links.finished(server, call.issued, bytes);
+			return true;
+		}
+		error = connected ? "timed out" : connecting ? "still connecting" : "disconnected";
+	} catch (rpc::rpc_error& e) {
+		error = e.what();
+	} catch (std::exception& e) {
+		error = e.what();
+	}
+
+	if (call.attempts > retries || !(connected || connecting)) {
+		log->error("{} of {} blocks on server {} failed after {} attempts: {}",
+		           method, call.batch->size(), server, call.attempts, error);
+		for (auto& block : *call.batch) {
+			acks.fail(block->owner());
+		}
+		return true;
+	}
+	log->warn("{} on server {} failed ({}), retrying", method, server, error);
+	issue(call);
+	return false;
+}
@@ -0,0 +1,132 @@
+#ifndef STOREWINDOW_HPP
+#define STOREWINDOW_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rpc/client.h"
+
+#include "BoundedQueue.hpp"
+#include "LinkEstimator.hpp"
+#include "SharedPayload.hpp"
+
+using namespace std;
+
+// Entries are shared by the batches of every server holding a replica
+typedef vector<PackedBlockPtr> BlockBatch;
+
+// Replica writes of each block, counted across every server. A block is
+// done once quorum of its replicas acknowledged it (all of them when
+// quorum is 0), or failed once too many replica writes failed for that
+// to happen. The fragments of an erasure-coded block count as its
+// replicas.
+class ReplicaAcks {
+public:
+	explicit ReplicaAcks(int t_quorum);
+
+	// Records a replica of hash on server; false if it was already placed
+	// there. least is the number of acks the block needs whatever the
+	// quorum, such as k for a block cut into k-of-n fragments.
+	bool expect(const string& hash, int server, int least = 1);
+
+	void ack(const string& hash);
+	void fail(const string& hash);
+
+	// Waits until every block is done or failed; returns how many failed
+	size_t wait();
+
+protected:
+	struct Entry {
+		uint16_t expected;
+		uint16_t acked;
+		uint16_t failed;
+		uint16_t least;
+		vector<int> servers;
+	};
+
+	int needed(const Entry& e) const;
+	bool settled(const Entry& e) const;
+
+	int quorum;
+	map<string, Entry> blocks;
+	size_t unsettled;
+	mutex mtx;
+	condition_variable changed;
+};
+
+// Sends store_blocks (or store_coded_blocks) batches to one server,
+// keeping up to window calls outstanding, so throughput is bounded by
+// bandwidth rather than by one round trip per batch. One thread issues
+// calls while the window has room; another waits on the oldest call and
+// retires it, waking the first. Neither polls. Servers do not wait on
+// each other: a slow replica only holds up its own queue.
+//
+// A call that fails or times out is sent again, up to retries more
+// times; after that each block in it counts as a failed replica write.
+// A client still connecting is waited for like a slow reply. Each
+// outstanding call holds its packed request, and at most window more
+// batches wait to be sent, so memory is bounded by 2 * window batches
+// per server. Calls answered are timed into links.
+class StoreWindow {
+public:
+	StoreWindow(rpc::client* t_client, int t_server, const string& t_method, size_t t_window,
+	            int t_retries, uint64_t t_timeoutMs, ReplicaAcks& t_acks, LinkEstimator& t_links);
+	~StoreWindow();
+
+	// Queues the batch; waits while window batches are already queued
+	void send(BlockBatch batch);
+
+	// Sends everything queued and waits for every outstanding call
+	void drain();
+
+protected:
+	struct Call {
+		shared_ptr<const BlockBatch> batch; // kept for resending
+		future<RPCLIB_MSGPACK::object_handle> result;
+		chrono::steady_clock::time_point issued;
+		int attempts;
+	};
+
+	// Sender: issues queued batches while the window has room
+	void run();
+	// Reaper: retires the oldest call once it is answered or given up on
+	void reap();
+	void issue(Call& call);
+
+	// Waits for call until it is due; true once it succeeded or was
+	// given up on, false if it was sent again
+	bool complete(Call& call);
+
+	rpc::client* client;
+	int server;
+	string method; // the store RPC the batches are packed for
+	size_t window;
+	int retries;
+	uint64_t timeoutMs;
+	ReplicaAcks& acks;
+	LinkEstimator& links;
+
+	BoundedQueue<BlockBatch> queued;
+
+	// Sender and reaper both issue calls; one client call at a time
+	mutex calling;
+
+	// inflight only grows at the back (sender) and shrinks at the front
+	// (reaper), so the reaper's reference to the oldest call stays valid
+	mutex mtx;
+	condition_variable changed; // a call was issued or retired, or sending ended
+	deque<Call> inflight;
+	bool sending;
+
+	thread sender;
+	thread reaper;
+};
+
+#endif // STOREWINDOW_HPP
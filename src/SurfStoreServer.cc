@@ -1,9 +1,17 @@
 #include <sysexits.h>
 #include <string>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <utility>
+#include <algorithm>
 
 #include "rpc/server.h"
+#include "rpc/this_handler.h"
 
 #include "logger.hpp"
+#include "BlockCodec.hpp"
 #include "SurfStoreTypes.hpp"
 #include "SurfStoreServer.hpp"
 
@@ -29,6 +37,85 @@ SurfStoreServer::SurfStoreServer(INIReader& t_config, int t_servernum)
 		log->error("The port provided is invalid: {}", servconf);
 		exit(EX_CONFIG);
 	}
+
+	// Number of threads servicing RPCs
+	threads = (int) config.GetInteger("ssd", "threads", 1);
+	if (threads <= 0) {
+		log->error("Invalid number of server threads: {}", threads);
+		exit(EX_CONFIG);
+	}
+
+	// Keep blocks on disk under data_dir if one is given
+	data_dir = config.Get("ssd", "data_dir", "");
+	if (data_dir != "") {
+		data_dir += "/" + serverid;
+
+		long segment_mb = config.GetInteger("ssd", "segment_mb", 256);
+		if (segment_mb <= 0) {
+			log->error("Invalid segment size: {}", segment_mb);
+			exit(EX_CONFIG);
+		}
+		if (!blocks.open(data_dir, (uint64_t) segment_mb << 20)) {
+			log->error("Unable to open block store in {}", data_dir);
+			exit(EX_CANTCREAT);
+		}
+	}
+
+	// Bloom filter over stored blocks. filter_bits caps its memory; the
+	// copy handed to clients is folded to filter_bits_per_block per block.
+	long filter_bits = config.GetInteger("ssd", "filter_bits", 1L << 24);
+	filter_bits_per_block = (int) config.GetInteger("ssd", "filter_bits_per_block", 10);
+	if (filter_bits <= 0 || filter_bits_per_block <= 0) {
+		log->error("Invalid filter size: {} bits, {} bits per block", filter_bits, filter_bits_per_block);
+		exit(EX_CONFIG);
+	}
+	filter.reset(new BloomFilter(filter_bits, BloomFilter::optimalHashes(filter_bits_per_block)));
+	blocks.forEach([&](const BlockDigest& digest) {
+		filter->add(digest);
+	});
+}
+
+//---------------------------------------------------
+//-- FileInfo records persist as an append-only log --
+//---------------------------------------------------
+
+// Replays data_dir/fileinfo.log into metaMap and opens it for appends.
+// A record torn by a crash ends the replay.
+bool SurfStoreServer::loadFileInfo(FileInfoMap& metaMap)
+{
+	string path = data_dir + "/fileinfo.log";
+
+	std::ifstream in(path, std::ifstream::binary);
+	if (in) {
+		std::stringstream contents;
+		contents << in.rdbuf();
+		string bytes = contents.str();
+
+		size_t offset = 0;
+		while (offset < bytes.size()) {
+			RPCLIB_MSGPACK::object_handle oh;
+			try {
+				RPCLIB_MSGPACK::unpack(oh, bytes.data(), bytes.size(), offset);
+				auto record = oh.get().as<std::tuple<string, FileInfo>>();
+				metaMap[get<0>(record)] = get<1>(record);
+			} catch (std::exception &e) {
+				break;
+			}
+		}
+	}
+
+	metaLog.open(path, std::ofstream::binary | std::ofstream::app);
+	return metaLog.good();
+}
+
+bool SurfStoreServer::appendFileInfo(const string& filename, const FileInfo& finfo)
+{
+	RPCLIB_MSGPACK::sbuffer buffer;
+	RPCLIB_MSGPACK::pack(buffer, std::make_tuple(filename, finfo));
+
+	metaLog.write(buffer.data(), buffer.size());
+	metaLog.flush();
+	return metaLog.good();
 }
 
 void SurfStoreServer::launch()
@@ -38,9 +125,16 @@ void SurfStoreServer::launch()
     log->info("Launching SurfStore server");
     log->info("My ID is: {}", servernum);
     log->info("Port: {}", port);
+    log->info("Threads: {}", threads);
+    log->info("Block store: {} ({} blocks)", data_dir == "" ? "memory" : data_dir, blocks.size());
 
-	map<string, string> blockMap;                                           
         FileInfoMap metaMap;
+        mutex metaLock;
+
+	if (data_dir != "" && !loadFileInfo(metaMap)) {
+		log->error("Unable to open file info log in {}", data_dir);
+		exit(EX_CANTCREAT);
+	}
 
 	rpc::server srv(port);
 
@@ -52,22 +146,18 @@ void SurfStoreServer::launch()
 	});
 
 
-	// Get a block for a specific hash                                 
-        srv.bind("get_block", [&](string hash) {                                
-                                                                                
-                auto log = logger();                                            
-                log->info("get_block()");                                       
-                                                                                
-                for(auto it = blockMap.cbegin(); it != blockMap.cend(); ++it)   
-                {                                                               
-                                                                                
-                        if(it->first == hash){                                  
-                                return it->second;                              
-                        }                                                       
-                }                                                               
-                                                                                
-                log->error("No matching hash");                                 
-                return blockMap[hash];                                          
+	// Get a block for a specific hash
+        srv.bind("get_block", [&](string hash) {
+
+                auto log = logger();
+                log->info("get_block()");
+
+                BlockDigest digest;
+                string block;
+                if (!BlockDigest::fromHex(hash, digest) || !blocks.get(digest, block)) {
+                        log->error("No matching hash");
+                }
+                return block;
         });
 
 	// Store a block
@@ -76,18 +166,130 @@ void SurfStoreServer::launch()
 
                 auto log = logger();
 
-                blockMap[hash] = data;
+                BlockDigest digest;
+                if (!BlockDigest::fromHex(hash, digest)) {
+                        log->error("Invalid block hash {}", hash);
+                        rpc::this_handler().respond_error("invalid block hash " + hash);
+                        return;
+                }
+                if (!blocks.put(digest, data)) {
+                        log->error("Unable to store block {}", hash);
+                        rpc::this_handler().respond_error("unable to store block " + hash);
+                        return;
+                }
+                filter->add(digest);
 
                 return;
         });
 
+	// Get several blocks in one round trip; a missing block comes back empty
+        srv.bind("get_blocks", [&](vector<string> hashes) {
+
+                auto log = logger();
+                log->info("get_blocks({})", hashes.size());
+
+                vector<string> ret(hashes.size());
+                for (size_t i = 0; i < hashes.size(); ++i) {
+                        BlockDigest digest;
+                        if (!BlockDigest::fromHex(hashes[i], digest) || !blocks.get(digest, ret[i])) {
+                                log->error("No matching hash {}", hashes[i]);
+                        }
+                }
+                return ret;
+        });
+
+	// Store several (hash, block) pairs in one round trip
+        srv.bind("store_blocks", [&](vector<pair<string, string>> batch) {
+
+                auto log = logger();
+                log->info("store_blocks({})", batch.size());
+
+                for (auto& entry : batch) {
+                        BlockDigest digest;
+                        if (!BlockDigest::fromHex(entry.first, digest)) {
+                                log->error("Invalid block hash {}", entry.first);
+                                rpc::this_handler().respond_error("invalid block hash " + entry.first);
+                                return;
+                        }
+                        if (!blocks.put(digest, entry.second)) {
+                                log->error("Unable to store block {}", entry.first);
+                                rpc::this_handler().respond_error("unable to store block " + entry.first);
+                                return;
+                        }
+                        filter->add(digest);
+                }
+        });
+
+	// Codecs this server can store and serve compressed blocks in. Older
+	// servers lack the call, and clients then fall back to raw blocks.
+        srv.bind("get_codecs", []() {
+                return BlockCodec::names();
+        });
+
+	// Store several (hash, coded block) pairs, keeping each block in the
+	// codec the client compressed it with
+        srv.bind("store_coded_blocks", [&](vector<pair<string, string>> batch) {
+
+                auto log = logger();
+                log->info("store_coded_blocks({})", batch.size());
+
+                for (auto& entry : batch) {
+                        BlockDigest digest;
+                        int codec;
+                        const char* payload;
+                        size_t len;
+                        string block;
+                        if (!BlockDigest::fromHex(entry.first, digest)) {
+                                log->error("Invalid block hash {}", entry.first);
+                                rpc::this_handler().respond_error("invalid block hash " + entry.first);
+                                return;
+                        }
+                        if (!BlockCodec::untag(entry.second, codec, payload, len)) {
+                                log->error("Unknown codec for block {}", entry.first);
+                                rpc::this_handler().respond_error("unknown codec for block " + entry.first);
+                                return;
+                        }
+                        // A payload that does not decode would only fail on the way out
+                        if (codec != BlockCodec::CODEC_RAW && !BlockCodec::decompress(codec, payload, len, block)) {
+                                log->error("Block {} does not decode", entry.first);
+                                rpc::this_handler().respond_error("block " + entry.first + " does not decode");
+                                return;
+                        }
+                        entry.second.erase(0, 1);
+                        if (!blocks.put(digest, entry.second, codec)) {
+                                log->error("Unable to store block {}", entry.first);
+                                rpc::this_handler().respond_error("unable to store block " + entry.first);
+                                return;
+                        }
+                        filter->add(digest);
+                }
+        });
+
+	// Get several blocks as stored, each behind its codec byte, so
+	// compressed blocks cross the network compressed; a missing block
+	// comes back empty
+        srv.bind("get_coded_blocks", [&](vector<string> hashes) {
+
+                auto log = logger();
+                log->info("get_coded_blocks({})", hashes.size());
+
+                vector<string> ret(hashes.size());
+                for (size_t i = 0; i < hashes.size(); ++i) {
+                        BlockDigest digest;
+                        if (!BlockDigest::fromHex(hashes[i], digest) || !blocks.getCoded(digest, ret[i])) {
+                                log->error("No matching hash {}", hashes[i]);
+                        }
+                }
+                return ret;
+        });
+
         // Download a FileInfo Map from the server
         srv.bind("get_fileinfo_map", [&]() {
 
                 auto log = logger();
                 log->info("get_fileinfo_map()");
 
-                //return fmap;
+                lock_guard<mutex> guard(metaLock);
                 return metaMap;
         });
 
@@ -98,7 +300,12 @@ void SurfStoreServer::launch()
                
 		log->info("File {} created", filename); 
 		
+		lock_guard<mutex> guard(metaLock);
 		metaMap[filename] = finfo;
+		if (data_dir != "" && !appendFileInfo(filename, finfo)) {
+			log->error("Unable to record file {}", filename);
+			rpc::this_handler().respond_error("unable to record file " + filename);
+		}
 	       	
 		/*
                 // File doesn't exist then create                                  
@@ -116,23 +323,45 @@ void SurfStoreServer::launch()
                                                                                    
         });
 
+	// Which of the given blocks this server holds, as a bitmap
+        srv.bind("has_blocks", [&](vector<string> hashes) {
+
+                auto log = logger();
+                log->info("has_blocks({})", hashes.size());
+
+                BlockBitmap bits((hashes.size() + 7) / 8, 0);
+                for (size_t i = 0; i < hashes.size(); ++i) {
+                        BlockDigest digest;
+                        if (BlockDigest::fromHex(hashes[i], digest) && blocks.contains(digest)) {
+                                bitmapSet(bits, i);
+                        }
+                }
+                return bits;
+        });
+
+	// Bloom filter summary of the stored blocks: (hash count, bits)
+        srv.bind("get_block_filter", [&]() {
+
+                auto log = logger();
+                log->info("get_block_filter()");
+
+                size_t nbits = std::max<size_t>(1024, blocks.size() * filter_bits_per_block);
+                return std::make_tuple(filter->hashes(), filter->fold(nbits));
+        });
+
 	// Get blocks stored at given server                            
         srv.bind("get_stored_blocks", [&]() {                                       
                                                                                    
                 auto log = logger();                                               
                 log->info("get_stored_blocks()");                                   
-                list<string> blocks;
-
-		map<string, string>::iterator it;
-       		for (it = blockMap.begin(); it != blockMap.end(); it++)
-       		{
-        	    blocks.push_back(it->first);
-       		}
-                                                                   
-                return blocks;
+                return blocks.hashes();
         }); 
 
 
 
+	// The launching thread services RPCs too, so this gives threads workers
+	if (threads > 1) {
+		srv.async_run(threads - 1);
+	}
 	srv.run();
 }
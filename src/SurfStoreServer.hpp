@@ -1,8 +1,13 @@
 #ifndef SURFSTORESERVER_HPP
 #define SURFSTORESERVER_HPP
 
+#include <fstream>
+
 #include "inih/INIReader.h"
 #include "logger.hpp"
+#include "SurfStoreTypes.hpp"
+#include "BlockStore.hpp"
+#include "BloomFilter.hpp"
 
 using namespace std;
 
@@ -15,9 +20,21 @@ public:
 	const uint64_t RPC_TIMEOUT = 10000; // milliseconds
 
 protected:
+	bool loadFileInfo(FileInfoMap& metaMap);
+	bool appendFileInfo(const string& filename, const FileInfo& finfo);
+
     INIReader& config;
 	const int servernum;
 	int port;
+	int threads;
+	string data_dir;
+	std::ofstream metaLog;
+
+	BlockStore blocks;
+
+	// Summary of stored blocks served to clients by get_block_filter
+	unique_ptr<BloomFilter> filter;
+	int filter_bits_per_block;
 };
 
 #endif // SURFSTORESERVER_HPP
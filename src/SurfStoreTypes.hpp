@@ -1,12 +1,46 @@
 #ifndef SURFSTORETYPES_HPP
 #define SURFSTORETYPES_HPP
 
+#include <stdint.h>
+#include <stdio.h>
 #include <tuple>
 #include <map>
 #include <list>
 #include <string>
+#include <vector>
 
 typedef tuple<int, list<string>> FileInfo;
 typedef map<string, FileInfo> FileInfoMap;
 
+// Reply to has_blocks: bit i (LSB first) is set if the server holds hash i
+typedef vector<unsigned char> BlockBitmap;
+
+// Reply to get_block_filter: Bloom filter hash count and bits
+typedef tuple<int, BlockBitmap> BlockFilterSummary;
+
+inline bool bitmapTest(const BlockBitmap& bits, size_t i) {
+	return i / 8 < bits.size() && ((bits[i / 8] >> (i % 8)) & 1);
+}
+
+inline void bitmapSet(BlockBitmap& bits, size_t i) {
+	bits[i / 8] |= (unsigned char) (1 << (i % 8));
+}
+
+// A file cut into fixed blocks of bytes bytes lists fixed(bytes) before
+// its block hashes, after any ec(k,m) or ring(r,...) marker, so the
+// downloader knows each block's offset before it arrives
+inline string fixedMarker(uint64_t bytes) {
+	return "fixed(" + to_string(bytes) + ")";
+}
+
+inline bool parseFixedMarker(const string& marker, uint64_t& bytes) {
+	unsigned long long n;
+	int used = 0;
+	if (sscanf(marker.c_str(), "fixed(%llu)%n", &n, &used) != 1 || used != (int) marker.size() || n == 0) {
+		return false;
+	}
+	bytes = n;
+	return true;
+}
+
 #endif // SURFSTORETYPES_HPP
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <fstream>
 #include <map>
+#include <set>
 #include <iostream>
 #include <sstream>
 #include <assert.h>
@@ -13,16 +14,25 @@
 #include <dirent.h>
 #include <assert.h>
 
-#include <stdlib.h>     // Random generator
-#include <time.h>       // Random seed
+#include <stdlib.h>
 #include <chrono>       // Timing library
+#include <atomic>
+#include <thread>
 
 #include "rpc/server.h"
 #include "rpc/rpc_error.h"
-#include "picosha2/picosha2.h"
 
 #include "logger.hpp"
 #include "Uploader.hpp"
+#include "BoundedQueue.hpp"
+#include "StoreWindow.hpp"
+#include "LinkEstimator.hpp"
+#include "HashRing.hpp"
+#include "Sha256.hpp"
+#include "BlockDigest.hpp"
+#include "BloomFilter.hpp"
+#include "BlockCodec.hpp"
+#include "ReedSolomon.hpp"
 
 using namespace std;
 
@@ -52,6 +62,25 @@ Uploader::Uploader(INIReader& t_config)
     }
     log->info("Using a block size of {}", blocksize);
 
+    // Read in how files are split: fixed-size blocks or content-defined
+    // chunks (min_chunk/avg_chunk/max_chunk, defaulting around blocksize)
+    chunking = config.Get("uploader", "chunking", "fixed");
+    if (chunking == "cdc") {
+        long avg_chunk = config.GetInteger("uploader", "avg_chunk", blocksize);
+        long min_chunk = config.GetInteger("uploader", "min_chunk", avg_chunk / 4);
+        long max_chunk = config.GetInteger("uploader", "max_chunk", avg_chunk * 4);
+        if (min_chunk <= 0 || avg_chunk < min_chunk || max_chunk < avg_chunk) {
+            log->error("Invalid chunk sizes: min {} avg {} max {}", min_chunk, avg_chunk, max_chunk);
+            exit(EX_CONFIG);
+        }
+        chunker.reset(new Chunker(min_chunk, avg_chunk, max_chunk));
+        log->info("Using content-defined chunks of {}/{}/{} bytes", min_chunk, avg_chunk, max_chunk);
+    }
+    else if (chunking != "fixed") {
+        log->error("Invalid chunking mode: {}", chunking);
+        exit(EX_CONFIG);
+    }
+
     // Read in the uploader's block placement policy
     policy = config.Get("uploader", "policy", "");
     if (policy == "") {
@@ -60,6 +89,80 @@ Uploader::Uploader(INIReader& t_config)
     }
     log->info("Using a block placement policy of {}", policy);
 
+    // Read in the byte budget for one store_blocks batch
+    batch_bytes = (int) config.GetInteger("uploader", "batch_bytes", 1 << 20);
+    if (batch_bytes <= 0) {
+        log->error("Invalid batch size: {}", batch_bytes);
+        exit(EX_CONFIG);
+    }
+    log->info("Using a batch size of {} bytes", batch_bytes);
+
+    // Ask servers which blocks they hold before sending any
+    skip_existing = config.GetBoolean("uploader", "skip_existing", true);
+
+    // Screen those questions with each server's Bloom filter summary
+    prefilter = config.GetBoolean("uploader", "prefilter", true);
+
+    // SHA-256 implementation: auto picks the fastest one this CPU has
+    string hash_backend = config.Get("uploader", "hash_backend", "auto");
+    if (hash_backend != "auto") {
+        Sha256::Backend backend;
+        if (!Sha256::parse(hash_backend, backend)) {
+            log->error("Invalid hash_backend: {}", hash_backend);
+            exit(EX_CONFIG);
+        }
+        if (!Sha256::use(backend)) {
+            log->error("hash_backend {} is not supported on this CPU", hash_backend);
+            exit(EX_CONFIG);
+        }
+    }
+    log->info("Hashing with {}", Sha256::name(Sha256::backend()));
+
+    // Hash workers in the upload pipeline; defaults to one per core
+    threads = (int) config.GetInteger("uploader", "threads", (long) std::thread::hardware_concurrency());
+    if (threads <= 0) {
+        threads = 1;
+    }
+    log->info("Using {} hash threads", threads);
+
+    // store_blocks calls outstanding per server, and how often a failed
+    // one is sent again
+    window = (int) config.GetInteger("uploader", "window", 8);
+    if (window <= 0) {
+        log->error("Invalid window: {}", window);
+        exit(EX_CONFIG);
+    }
+    retries = (int) config.GetInteger("uploader", "retries", 3);
+    if (retries < 0) {
+        log->error("Invalid retries: {}", retries);
+        exit(EX_CONFIG);
+    }
+    log->info("Using a window of {} calls per server, {} retries", window, retries);
+
+    // Replica acknowledgements a block needs; 0 waits for all of them
+    quorum = (int) config.GetInteger("uploader", "quorum", 0);
+    if (quorum < 0) {
+        log->error("Invalid quorum: {}", quorum);
+        exit(EX_CONFIG);
+    }
+
+    // Servers are pinged this often to track their round trips (0: only
+    // at startup)
+    probe_ms = (int) config.GetInteger("uploader", "probe_ms", 1000);
+    if (probe_ms < 0) {
+        log->error("Invalid probe_ms: {}", probe_ms);
+        exit(EX_CONFIG);
+    }
+
+    // Per-block compression: lz4 (fast), lz4hc (smaller) or none. Only
+    // used with servers that report the codec.
+    string compression_name = config.Get("uploader", "compression", "lz4");
+    if (!BlockCodec::parseLevel(compression_name, compression)) {
+        log->error("Invalid compression: {}", compression_name);
+        exit(EX_CONFIG);
+    }
+    log->info("Using {} compression", compression_name);
+
     num_servers = (int) config.GetInteger("ssd", "num_servers", -1);
     if (num_servers <= 0) {
         log->error("num_servers {} is invalid", num_servers);
@@ -90,135 +193,152 @@ Uploader::Uploader(INIReader& t_config)
         ssdports.push_back(port);
     }
 
-    log->info("Uploader initalized");
-}
-
-//-----------------------------------------
-//----- Get local server based on RTT -----
-//-----------------------------------------
-
-int Uploader::getLocalServer(vector<double> RTT){
-
-    int locServer = 0;
+    // ec(k,m) stripes each block over k + m different servers
+    int ec_k, ec_m;
+    if (ReedSolomon::parse(policy, ec_k, ec_m)) {
+        erasure.reset(new ReedSolomon(ec_k, ec_m));
+        log->info("Coding with {}", ReedSolomon::name(ReedSolomon::backend()));
+    }
+    else if (policy.compare(0, 3, "ec(") == 0) {
+        log->error("Invalid erasure code: {}", policy);
+        exit(EX_CONFIG);
+    }
 
-    for (int n = 1; n < num_servers; ++n){
-        if(RTT[locServer] > RTT[n]){
-            locServer = n;
+    // ring(r) puts each block on the r servers after it on a consistent
+    // hashing ring, which the downloader computes the same way
+    if (HashRing::parse(policy, ring_replicas)) {
+        vnodes = (int) config.GetInteger("ssd", "vnodes", HashRing::DEFAULT_VNODES);
+        if (vnodes <= 0) {
+            log->error("Invalid vnodes: {}", vnodes);
+            exit(EX_CONFIG);
         }
+        log->info("Placing on a ring of {} points per server", vnodes);
+    }
+    else if (policy.compare(0, 5, "ring(") == 0) {
+        log->error("Invalid ring policy: {}", policy);
+        exit(EX_CONFIG);
     }
-    return locServer;
-}
-
-//-------------------------------------------
-//----- Get closest server based on RTT -----
-//-------------------------------------------
 
-int Uploader::getClosestServer(vector<double> RTT, int locServer){
+    // The policy places each file's new blocks in one batch; the local
+    // ones follow the RTTs measured while uploading
+    links.reset(new LinkEstimator(num_servers));
+    vector<int> all;
+    for (int i = 0; i < num_servers; ++i) {
+        all.push_back(i);
+    }
+    string error;
+    if (!placeOver(all, error)) {
+        log->error("{}", error);
+        exit(EX_CONFIG);
+    }
 
-    auto log = logger();   
-    
-    int closeServer = getRandomServer(locServer);
+    log->info("Uploader initalized");
+}
 
-    for (int n = 0; n < num_servers; ++n){
-        if( (RTT[closeServer] > RTT[n]) && (n != locServer) ){
-            closeServer = n;
+bool Uploader::placeOver(const vector<int>& servers, string& error)
+{
+    placed_on = servers;
+
+    // A ring of other servers has another fingerprint, so the downloader
+    // locates its blocks rather than computing where they are
+    if (HashRing::parse(policy, ring_replicas)) {
+        vector<string> names, zones;
+        for (int i : servers) {
+            names.push_back(ssdhosts[i] + ":" + std::to_string(ssdports[i]));
+            zones.push_back(config.Get("ssd", "zone"+std::to_string(i), ""));
         }
+        ring.reset(new HashRing(names, zones, vnodes));
     }
-    return closeServer;
-}
 
-//--------------------------------------------
-//----- Get farthest server based on RTT -----
-//--------------------------------------------
-
-int Uploader::getFarthestServer(vector<double> RTT, int locServer){
-
-    int farServer = 0;
-    for (int n = 1; n < num_servers; ++n){
-        if( (RTT[farServer] < RTT[n]) && (n != locServer) ){
-            farServer = n;
+    // The RTT order of the servers, as placement numbers them
+    auto order = [this]() {
+        vector<int> numbered;
+        for (int s : links->order()) {
+            auto at = find(placed_on.begin(), placed_on.end(), s);
+            if (at != placed_on.end()) {
+                numbered.push_back((int) (at - placed_on.begin()));
+            }
         }
-    }
-    return farServer;
+        return numbered;
+    };
+    placement = Placement::create(policy, (int) servers.size(), order, ring.get(), error);
+    return placement != nullptr;
 }
 
-//------------------------------------------
-//----- Get random server based on RTT -----
-//------------------------------------------
-
-int Uploader::getRandomServer(int takenServer){
+//--------------------------------------------------------
+//-- Ask a server which of the given blocks it holds --
+//--------------------------------------------------------
 
-    if( takenServer == -1 ){
+vector<bool> Uploader::hasBlocks(rpc::client* client, const vector<string>& hashes){
 
-        return rand() % 4; // % num_servers
-    }
-    else{
-        int randServer2 = takenServer;
-        while( randServer2 == takenServer ){
-            randServer2 = rand() % 4; // % num_servers
-        }
-        return randServer2;
-    }
-}
+    vector<bool> has(hashes.size(), false);
 
-//-----------------------------------------------------------------             
-//---------------- Get all bytes from given file ------------------             
-//-----------------------------------------------------------------             
+    // Keep each query within the batch budget (hex hashes are 64 bytes)
+    size_t span = std::max(1, batch_bytes / 64);
 
-string Uploader::getAllBytes(string fileName) {                          
+    for (size_t first = 0; first < hashes.size(); first += span) {
 
+        size_t last = std::min(hashes.size(), first + span);
+        vector<string> batch(hashes.begin() + first, hashes.begin() + last);
 
-    std::ifstream is (base_dir + '/' + fileName, std::ifstream::binary);    
+        BlockBitmap bits = client->call("has_blocks", batch).as<BlockBitmap>();
 
-    if (is) {                                                               
-        string ret;                                                     
-
-        // get length of file:                                          
-        is.seekg (0, is.end);                                           
-        int length = is.tellg();                                        
-        is.seekg (0, is.beg);                                           
+        for (size_t i = first; i < last; i++){
+            has[i] = bitmapTest(bits, i - first);
+        }
+    }
+    return has;
+}
 
-        char * buffer = new char [length];                              
+//-----------------------------------------------------------------
+//-------------------- Map given file into memory -----------------
+//-----------------------------------------------------------------
 
-        is.read (buffer,length);                                        
+shared_ptr<MappedFile> Uploader::mapFile(string fileName) {
 
-        is.close();                                                     
-        ret.assign(buffer, length);                                     
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
 
-        return ret;                                                     
-    }                                                                       
-    return NULL;                                                            
+    if (!file->openReadOnly(base_dir + '/' + fileName)) {
+        return nullptr;
+    }
+    return file;
 }
 
-//-------------------------------------------------------------------------     
-//-------------- Turns file into a map of hashes to blocks ----------------     
-//-------------------------------------------------------------------------     
+//-------------------------------------------------------------------------
+//---------------- Splits a mapped file into block views ------------------
+//-------------------------------------------------------------------------
 
-vector<string> Uploader::getBlocks(string fileName) {                    
+vector<BlockView> Uploader::getBlocks(const shared_ptr<MappedFile>& file) {
 
-    vector<string> blockList;                                               
-    string file_string = getAllBytes(fileName);                             
+    vector<BlockView> blockList;
+    const unsigned char* data = (const unsigned char*) file->data();
+    size_t length = file->size();
 
-    for (size_t start = 0; start <  file_string.length(); start += blocksize) {
+    for (size_t start = 0; start < length; ) {
 
-        int end = start + blocksize;                                    
+        size_t len = (size_t) blocksize;
 
-        // Remaining bytes case                                         
-        if ( file_string.length() - start < (unsigned)blocksize) {      
-            end = file_string.length();                             
-        }                                                               
+        if (chunker) {
+            len = chunker->nextChunk(data + start, length - start);
+        }
+
+        // Remaining bytes case
+        else if (length - start < len) {
+            len = length - start;
+        }
 
-        string block = file_string.substr(start, end - start);      
-        blockList.push_back(block);                                     
-    }                                                                       
-    return blockList;                                                       
+        BlockView block = { file, start, len };
+        blockList.push_back(block);
+        start += len;
+    }
+    return blockList;
 }
 
 //----------------------------------------
 //--------- Main upload function ---------
 //----------------------------------------
 
-void Uploader::upload()
+bool Uploader::upload()
 {
     auto log = logger();
 
@@ -237,242 +357,559 @@ void Uploader::upload()
         }
     }
 
-/*
-    // Issue a ping to each server
-    for (int i = 0; i < num_servers; ++i)
-    {
-        log->info("Pinging server {}", i);
-        try {
-            clients[i]->call("ping");
-            log->info("  success");
-        } catch (rpc::timeout &t) {
-            log->error("Error pinging server {}: {}", i, t.what());
-            exit(-1);
-        }
-    }
-*/
-
-    //-----------------------------------
-    //-- Classify Servers based on RTT --
-    //-----------------------------------
-
-    vector<double> avgRTT;
-    
-    log->info("Calculating average RTTs\n");
+    // Time every server at once, then keep timing them in the background
+    // and from the store calls, so placement follows the current RTTs
+    vector<bool> answered = links->probe(clients, RPC_TIMEOUT);
 
+    // Blocks are placed over the servers that answered, as if they were
+    // all there are
+    vector<int> live;
     for (int n = 0; n < num_servers; ++n){
+        if (!answered[n]){
+            log->error("Error pinging server {}, placing blocks on the others", n);
+            continue;
+        }
+        live.push_back(n);
+        log->info("RTT for server {}: {} ms", n, links->rtt(n));
+    }
+    if ((int) live.size() < num_servers) {
+        string error;
+        if (!placeOver(live, error)) {
+            log->error("{}", error);
+            exit(EX_UNAVAILABLE);
+        }
+    }
+    if (probe_ms > 0){
+        links->start(ssdhosts, ssdports, probe_ms, RPC_TIMEOUT);
+    }
 
-        log->info("Ping timing for server {}", n);
-
-        int ping_num = 8;
-        std::chrono::duration<double> elapsed;
-        double avg = 0.0;
-
-        for (int i = 0; i < ping_num; ++i){
-
+    int nearest = links->nearest();
+    log->info("Local Server: {}", nearest);
+    log->info("Closest Server: {}", links->nearest(nearest));
+    log->info("Farthest Server: {}", links->farthest(nearest));
+
+    // Servers that can store compressed blocks get them through
+    // store_coded_blocks; older ones, which lack get_codecs, get raw
+    // blocks through store_blocks
+    vector<bool> coding(num_servers, false);
+    if (compression != BlockCodec::NONE) {
+        for (int n = 0; n < num_servers; n++){
+            if (!answered[n]) {
+                continue;
+            }
             try {
-
-                // Record start time
-                auto start = std::chrono::high_resolution_clock::now();
-
-                clients[n]->call("ping");
-
-                // Record end time
-                auto finish = std::chrono::high_resolution_clock::now();
-
-                elapsed = finish - start;
-
-                avg = avg + (elapsed.count()*1000)/ping_num;
-                log->info("Ping {}: {}", i+1, (elapsed.count()*1000)); 
-
-            } catch (rpc::timeout &t) {
-                log->error("Error pinging server {}: {}", 0, t.what());
-                exit(-1);
+                vector<string> codecs = clients[n]->call("get_codecs").as<vector<string>>();
+                coding[n] = find(codecs.begin(), codecs.end(), "lz4") != codecs.end();
+            } catch (std::exception& e) {
+                log->info("Server {} does not take compressed blocks", n);
             }
         }
-        avgRTT.push_back(avg);
-        log->info("Server {} avg RTT: {}", n, avg);
-    }
-
-    // Assign servers based on RTTs
-    int localServer = getLocalServer(avgRTT);
-    int closestServer = getClosestServer(avgRTT, localServer);
-    int farthestServer = getFarthestServer(avgRTT, localServer);
-
-
-    // Print Results
-    for (int n = 0; n < num_servers; ++n){
-        log->info("Average RTT for server {}: {}", n, avgRTT[n]);
     }
-    log->info("Local Server: {}", localServer);
-    log->info("Closest Server: {}", closestServer);
-    log->info("Farthest Server: {}", farthestServer);
 
     //--------------------------------------------------------
     //-- Parse base directory and populate maps accordingly --
     //--------------------------------------------------------
 
-    FileInfoMap localMap; // typedef map<string, FileInfo> FileInfoMap; 
-
-    map<string, string> localBlockMap; // maps hash, block data 
-
+    // Files go through a pipeline of scan -> map and chunk -> hash ->
+    // upload, with bounded queues between stages. Hash workers split
+    // files into jobs of about HASH_JOB_BYTES, so several large files use
+    // all the cores, and hashing overlaps with the uploads below. Blocks
+    // are erasure coded and compressed in the upload stage, a group at a
+    // time, once it is known which of them are sent.
 
+    log->info("Upload to server");
 
-    vector<string> file_names;                                              
-
-    if (auto dir = opendir(base_dir.c_str())) {                             
-        while (auto f = readdir(dir)) {                                 
-            if (!f->d_name || f->d_name[0] == '.')                  
-                continue; // Skip everything that starts with a dot
-            file_names.push_back(f->d_name);                        
-            // log->info("File: {}", f->d_name);                    
-        }                                                               
-        closedir(dir);                                                  
-    }                                                                       
-
-    // for each file, compute that file’s hash list | create mapping for blocks and FileInfos
-    for (string s: file_names) {                                            
-
-        // blocks b0, b1, b2, and b3                                                        
-        vector<string> blocks = getBlocks(s);
-        list<string> hash_list;                                 
-
-        // iterates through list of blocks for particular file
-        for (auto b: blocks) { 
+    // Timing purposes
+    auto starttime = std::chrono::high_resolution_clock::now();
 
-            // for each block
-            string tmpHash = picosha2::hash256_hex_string(b); 
+    BoundedQueue<string> names(64);
+    BoundedQueue<HashJob> hashJobs(4 * threads);
+    BoundedQueue<shared_ptr<ChunkedFile>> ready(4 * threads);
+
+    // Scan: every regular entry of base_dir
+    thread scanner([&]() {
+        if (auto dir = opendir(base_dir.c_str())) {                             
+            while (auto f = readdir(dir)) {                                 
+                if (f->d_name[0] == '.')                  
+                    continue; // Skip everything that starts with a dot
+                names.push(f->d_name);                        
+                // log->info("File: {}", f->d_name);                    
+            }                                                               
+            closedir(dir);                                                  
+        }                                                                       
+        names.close();
+    });
+
+    // Files that could not be mapped; they fail the upload like lost blocks
+    atomic<size_t> unreadable(0);
+
+    // Map and chunk: one file at a time, cut into hash jobs
+    thread reader([&]() {
+        string name;
+        while (names.pop(name)) {
+
+            shared_ptr<ChunkedFile> chunked = make_shared<ChunkedFile>();
+            chunked->name = name;
+            chunked->file = mapFile(name);
+            if (!chunked->file) {
+                log->error("Unable to read file {}", name);
+                unreadable++;
+                continue;
+            }
 
-            //{h0:b0, h1:b2}
-            localBlockMap.insert({tmpHash, b}); 
+            // blocks b0, b1, b2, and b3                                                        
+            chunked->blocks = getBlocks(chunked->file);
+            chunked->hashes.resize(chunked->blocks.size());
+            chunked->pieces = erasure ? erasure->fragments() : 1;
+            chunked->keys.resize(chunked->blocks.size() * chunked->pieces);
+
+            vector<HashJob> jobs;
+            size_t bytes = 0;
+            for (size_t i = 0; i < chunked->blocks.size(); i++) {
+                if (jobs.empty() || bytes >= HASH_JOB_BYTES) {
+                    HashJob job = { chunked, i, i };
+                    jobs.push_back(job);
+                    bytes = 0;
+                }
+                jobs.back().last = i + 1;
+                bytes += chunked->blocks[i].size();
+            }
 
-            // [h0, h1, h2, h3]
-            hash_list.push_back(tmpHash); 
+            // Empty files have nothing to hash
+            if (jobs.empty()) {
+                ready.push(chunked);
+                continue;
+            }
+            chunked->unhashed = jobs.size();
+            for (auto& job : jobs) {
+                hashJobs.push(job);
+            }
+        }
+        hashJobs.close();
+    });
 
-        }                                                       
+    // Keys of block i's pieces: its hash, or its fragments' hashes
+    auto fillKeys = [&](ChunkedFile& chunked, size_t i) {
+        const string& hash = chunked.hashes[i];
+        size_t at = i * chunked.pieces;
 
-        // version number should nev
-        FileInfo fileI = std::make_tuple(1, hash_list); 
-        localMap.insert({s, fileI});                            
+        if (!erasure) {
+            chunked.keys[at] = hash;
+            return;
+        }
+        for (size_t f = 0; f < chunked.pieces; f++){
+            chunked.keys[at + f] = erasure->fragmentHash(hash, (int) f);
+        }
+    };
+
+    // Hash: each job's blocks in one call so multi-buffer backends fill
+    // their lanes, then fill in their keys. Whoever finishes a file's
+    // last job passes it on, and the last worker to leave closes the
+    // upload queue.
+    atomic<int> hashers(threads);
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&]() {
+            HashJob job;
+            while (hashJobs.pop(job)) {
+                ChunkedFile& chunked = *job.file;
+                size_t count = job.last - job.first;
+
+                vector<const unsigned char*> blockData;
+                vector<size_t> blockLens;
+                for (size_t i = job.first; i < job.last; i++) {
+                    blockData.push_back((const unsigned char*) chunked.blocks[i].data());
+                    blockLens.push_back(chunked.blocks[i].size());
+                }
+                vector<uint8_t> digests(count * Sha256::SIZE);
+                Sha256::hashMany(count, blockData.data(), blockLens.data(), digests.data());
+
+                for (size_t i = 0; i < count; i++) {
+                    chunked.hashes[job.first + i] = Sha256::hex(&digests[i * Sha256::SIZE]);
+                    fillKeys(chunked, job.first + i);
+                }
+                if (chunked.unhashed.fetch_sub(1) == 1) {
+                    ready.push(job.file);
+                }
+            }
+            if (hashers.fetch_sub(1) == 1) {
+                ready.close();
+            }
+        }));
     }
 
     //-----------------------------
     //-- Set up upload to server --
     //-----------------------------
 
-    log->info("Upload to server");
+    // Blocks wait here per server until batch_bytes of them are queued,
+    // then go out in a single store_blocks call
+    vector<BlockBatch> pending(num_servers);
+    vector<size_t> pendingBytes(num_servers, 0);
+
+    // Replica writes of a block count as done once quorum of them are
+    // acknowledged
+    ReplicaAcks acks(quorum);
+
+    // Each server sends on its own thread, up to window batches at once,
+    // so the replicas of a block go out side by side
+    vector<unique_ptr<StoreWindow>> windows;
+    for (int n = 0; n < num_servers; n++){
+        const char* method = coding[n] ? "store_coded_blocks" : "store_blocks";
+        windows.push_back(unique_ptr<StoreWindow>(new StoreWindow(clients[n], n, method, window, retries, RPC_TIMEOUT, acks, *links)));
+    }
 
-    // Timing purposes
-    auto starttime = std::chrono::high_resolution_clock::now();
+    auto flush = [&](int n) {
+        windows[n]->send(std::move(pending[n]));
+        pending[n].clear();
+        pendingBytes[n] = 0;
+    };
 
-    // Iterator so we can loop                                              
-    std::map<string, FileInfo>::iterator local_it = localMap.begin();       
+    // Blocks each server already holds, so they are not sent again
+    vector<set<string>> stored(num_servers);
 
-    // Loop through local files                                             
-    while( local_it != localMap.end()){                                     
+    // Servers that stopped answering; their replica writes count as failed
+    vector<bool> down(num_servers, false);
+    for (int n = 0; n < num_servers; n++){
+        down[n] = !answered[n];
+    }
 
-        string local_filename = local_it->first;                        
+    auto markDown = [&](int n, const char* what, const std::exception& e) {
+        log->error("{} on server {} failed, not using it again: {}", what, n, e.what());
+        down[n] = true;
+    };
+
+    // Each server's Bloom filter summary, fetched once. A hash the filter
+    // rules out is not asked about; one it may contain is confirmed with
+    // has_blocks, since a false positive must not skip a block.
+    vector<BlockFilterSummary> summaries(num_servers);
+    vector<bool> summarized(num_servers, false);
+
+    if (skip_existing && prefilter) {
+        for (int n = 0; n < num_servers; n++){
+            if (down[n]) {
+                continue;
+            }
+            try {
+                summaries[n] = clients[n]->call("get_block_filter").as<BlockFilterSummary>();
+                summarized[n] = true;
+                log->info("Server {} filter: {} bytes", n, get<1>(summaries[n]).size());
+            } catch (std::exception& e) {
+                markDown(n, "get_block_filter", e);
+            }
+        }
+    }
 
-        // Get file info from local file                           
-        FileInfo local_info = localMap[local_filename];            
+    // Block bytes queued for sending, as sent, against the bytes of the files
+    size_t sentBytes = 0;
+    size_t totalBytes = 0;
+
+    // Whether key, the block hash or one of its fragments, still has to
+    // be sent to n; a replica that is already there, or cannot be
+    // written, is settled here. The block needs least replicas whatever
+    // the quorum.
+    auto needs = [&](int n, const string& hash, const string& key, int least) {
+        if (!acks.expect(hash, n, least)) {
+            return false; // already placed on n this session
+        }
+        if (down[n]) {
+            acks.fail(hash);
+            return false;
+        }
+        if (stored[n].count(key)) {
+            acks.ack(hash);
+            return false;
+        }
+        return true;
+    };
+
+    auto store = [&](int n, const PackedBlockPtr& block) {
+        pending[n].push_back(block);
+        pendingBytes[n] += block->size();
+        sentBytes += block->bodySize();
+        if (pendingBytes[n] >= (size_t) batch_bytes) {
+            flush(n);
+        }
+    };
+
+    // A block on its way out: the pieces its targets still need, as
+    // (piece, server), and each of those pieces packed as its servers
+    // take it
+    struct Outgoing {
+        size_t block;
+        vector<pair<size_t, int>> to;
+        vector<PackedBlockPtr> raw;
+        vector<PackedBlockPtr> coded;
+    };
+
+    // Pack: each piece referenced as it is for servers that take raw
+    // blocks, or compressed for those that take coded ones. Every piece
+    // is packed once, whichever servers get it. An erasure-coded block
+    // is cut into its fragments here, once, and each fragment goes to a
+    // single server, so it is moved into its packed form.
+    auto pack = [&](const ChunkedFile& chunked, Outgoing& out) {
+        const string& hash = chunked.hashes[out.block];
+        const BlockView& view = chunked.blocks[out.block];
+        size_t at = out.block * chunked.pieces;
+        out.raw.assign(chunked.pieces, nullptr);
+        out.coded.assign(chunked.pieces, nullptr);
+        string payload;
+
+        vector<string> fragments;
+        if (erasure) {
+            fragments = erasure->encode(view.data(), view.size());
+        }
 
-        for (int n = 0; n < num_servers; n++){ 
+        for (auto& to : out.to) {
+            size_t p = to.first;
+            bool coded = coding[to.second];
+
+            if (!erasure && !coded && !out.raw[p]) {
+                out.raw[p] = make_shared<const PackedBlock>(hash, view);
+            } else if (!erasure && coded && !out.coded[p]) {
+                if (BlockCodec::compress(view.data(), view.size(), compression, payload)) {
+                    out.coded[p] = make_shared<const PackedBlock>(hash, view, BlockCodec::CODEC_LZ4, std::move(payload));
+                } else {
+                    out.coded[p] = make_shared<const PackedBlock>(hash, view, BlockCodec::CODEC_RAW, string());
+                }
+            } else if (erasure && !coded && !out.raw[p]) {
+                out.raw[p] = make_shared<const PackedBlock>(chunked.keys[at + p], hash, -1, std::move(fragments[p]));
+            } else if (erasure && coded && !out.coded[p]) {
+                string& piece = fragments[p];
+                if (BlockCodec::compress(piece.data(), piece.size(), compression, payload)) {
+                    out.coded[p] = make_shared<const PackedBlock>(chunked.keys[at + p], hash, BlockCodec::CODEC_LZ4, std::move(payload));
+                } else {
+                    out.coded[p] = make_shared<const PackedBlock>(chunked.keys[at + p], hash, BlockCodec::CODEC_RAW, std::move(piece));
+                }
+            }
+        }
+    };
 
-            //log->info("Updating file {} on server {}", local_filename, n);           
+    // Policies that pick servers at random can use any server
+    bool anyServer = placement->anyServer();
 
-            // Update remote fileinfo                         
-            (void)clients[n]->call("record_file", local_filename, local_info);
-        }
+    // Hashes already placed this session; a repeat inside a file or
+    // across files is neither placed nor sent again
+    set<string> placed;
+    size_t repeats = 0;
 
+    // Loop through local files as they come out of the pipeline
+    shared_ptr<ChunkedFile> chunked;
+    while (ready.pop(chunked)) {                                     
 
-        // list of hashes of local file                            
-        list<string> local_hashlist = get<1>(local_info);          
+        string local_filename = chunked->name;                        
 
-        // For randomizing 
-        srand (time(NULL));
-	
-	// Iterate through all hashes to write to server        
-        std::list<string>::iterator it;                         
-        for (it = local_hashlist.begin(); it != local_hashlist.end(); ++it){
+        // version number should nev
+        list<string> hash_list(chunked->hashes.begin(), chunked->hashes.end());
+        // Fixed blocks start at known offsets, which the downloader writes
+        // them at as they arrive
+        if (!chunker) {
+            hash_list.push_front(fixedMarker(blocksize));
+        }
+        // An erasure-coded file's list starts with the code, which the
+        // downloader needs to find and rebuild its blocks
+        if (erasure) {
+            hash_list.push_front(erasure->name());
+        }
+        // A ring-placed one starts with the ring's marker, so the
+        // downloader knows where the blocks are without asking
+        if (ring) {
+            hash_list.push_front(ring->marker(ring_replicas));
+        }
+        FileInfo local_info = std::make_tuple(1, hash_list);            
 
-            string hash = it->c_str();                      
-            string block = localBlockMap[hash];             
+        // Packed once for all servers
+        auto packed_info = make_shared<const PackedValue>(local_info);
 
+        for (int n = 0; n < num_servers; n++){ 
 
-            //-------------------                                                      
-            //-- random Policy --                                                      
-            //-------------------
-            
-            if( policy == "random"){ 
+            //log->info("Updating file {} on server {}", local_filename, n);           
 
-                int randomServer = getRandomServer(-1);
-                (void)clients[randomServer]->call("store_block", hash, block);
-		
-		//log->info("Block stored in server {} with policy: \"{}\"", randomServer, policy);
+            if (down[n]) {
+                continue;
             }
 
-            //----------------------                                                
-            //-- tworandom Policy --                                                
-            //----------------------
-            
-            else if( policy == "tworandom"){ 
+            // Update remote fileinfo                         
+            try {
+                (void)clients[n]->call("record_file", local_filename, packed_info);
+            } catch (std::exception& e) {
+                markDown(n, "record_file", e);
+            }
+        }
 
-                int randomServer = getRandomServer(-1);
-                int randomServer2 = getRandomServer(randomServer);
+        // Place the first copy of each new hash; later copies are repeats
+        vector<size_t> fresh;
+        for (size_t i = 0; i < chunked->blocks.size(); i++){
+            totalBytes += chunked->blocks[i].size();
+            if (!placed.insert(chunked->hashes[i]).second) {
+                repeats++;
+                continue;
+            }
+            fresh.push_back(i);
+        }
 
-                (void)clients[randomServer]->call("store_block", hash, block);
-                (void)clients[randomServer2]->call("store_block", hash, block);
+        // Servers for all of them, placed as one batch
+        vector<BlockDigest> digests(fresh.size());
+        for (size_t j = 0; j < fresh.size(); j++){
+            BlockDigest::fromHex(chunked->hashes[fresh[j]], digests[j]);
+        }
+        int width = placement->width();
+        vector<int> chosen(fresh.size() * width);
+        placement->place(digests.data(), digests.size(), chosen.data());
+        for (int& s : chosen) {
+            s = placed_on[s];
+        }
+        vector<vector<int>> targets;
+        for (size_t j = 0; j < fresh.size(); j++){
+            targets.push_back(vector<int>(chosen.begin() + j * width, chosen.begin() + (j + 1) * width));
+        }
 
-		//log->info("Block stored in server {} with policy: \"{}\"", randomServer, policy);
-		//log->info("Block stored in server {} with policy: \"{}\"", randomServer2, policy);
+        // Ask each target which of its new blocks it already holds,
+        // leaving out those its filter rules out. Random policies may
+        // use any server, so every server is asked.
+        if (skip_existing) {
+            vector<vector<string>> ask(num_servers);
+            for (size_t j = 0; j < fresh.size(); j++){
+                vector<int> all;
+                if (anyServer) {
+                    for (int n = 0; n < num_servers; n++){
+                        all.push_back(n);
+                    }
+                }
+                const vector<int>& servers = anyServer ? all : targets[j];
+                for (size_t t = 0; t < servers.size(); t++) {
+                    int n = servers[t];
+                    // What it stores: the block itself, or one fragment of it
+                    const string& key = chunked->keys[fresh[j] * chunked->pieces + (erasure ? t : 0)];
+                    BlockDigest digest;
+                    if (summarized[n] && BlockDigest::fromHex(key, digest)
+                        && !BloomFilter::mayContain(get<1>(summaries[n]), get<0>(summaries[n]), digest)) {
+                        continue;
+                    }
+                    ask[n].push_back(key);
+                }
             }
-            
-            //------------------
-            //-- local Policy --
-            //------------------
-            
-            else if( policy == "local"){
-
-                (void)clients[localServer]->call("store_block", hash, block);
 
-		//log->info("Block stored in server {} with policy: \"{}\"", localServer, policy);
+            for (int n = 0; n < num_servers; n++){
+                if (down[n] || ask[n].empty()) {
+                    continue;
+                }
+                vector<bool> has;
+                try {
+                    has = hasBlocks(clients[n], ask[n]);
+                } catch (std::exception& e) {
+                    markDown(n, "has_blocks", e);
+                    continue;
+                }
+                size_t held = 0;
+                for (size_t i = 0; i < ask[n].size(); i++){
+                    if (has[i]) {
+                        stored[n].insert(ask[n][i]);
+                        held++;
+                    }
+                }
+                log->info("Server {} already holds {} of {} asked-about blocks of {}", n, held, ask[n].size(), local_filename);
             }
+        }
 
-            //-------------------------                                             
-            //-- localclosest Policy --                                             
-            //------------------------- 
-            
-            else if( policy == "localclosest"){
+        // Under a random policy, servers already holding a block stand in
+        // for the random picks, so an unchanged block is not sent again
+        if (anyServer) {
+            for (size_t j = 0; j < fresh.size(); j++){
+                const string& hash = chunked->hashes[fresh[j]];
+                vector<int> picked;
+                for (int n = 0; n < num_servers && picked.size() < targets[j].size(); n++){
+                    if (stored[n].count(hash)) {
+                        picked.push_back(n);
+                    }
+                }
+                for (int n : targets[j]) {
+                    if (picked.size() < targets[j].size() && find(picked.begin(), picked.end(), n) == picked.end()) {
+                        picked.push_back(n);
+                    }
+                }
+                targets[j] = picked;
+            }
+        }
+	
+	// Iterate through new hashes to find what each target still needs
+        vector<Outgoing> outgoing;
+        for (size_t j = 0; j < fresh.size(); j++){
+
+            const string& hash = chunked->hashes[fresh[j]];                      
+
+            size_t at = fresh[j] * chunked->pieces;
+            Outgoing out;
+            out.block = fresh[j];
+
+            // Each target gets its own fragment; any k of them rebuild
+            // the block
+            if (erasure) {
+                for (size_t t = 0; t < targets[j].size(); t++){
+                    int n = targets[j][t];
+                    if (needs(n, hash, chunked->keys[at + t], erasure->dataFragments())) {
+                        out.to.push_back(make_pair(t, n));
+                    }
+                }
+            } else {
+                for (int n : targets[j]) {
+                    if (needs(n, hash, hash, 1)) {
+                        out.to.push_back(make_pair(0, n));
+                    }
+                }
+            }
+            if (!out.to.empty()) {
+                outgoing.push_back(std::move(out));
+            }
+        }
 
-                (void)clients[localServer]->call("store_block", hash, block);
-                (void)clients[closestServer]->call("store_block", hash, block);
+        // Packed about threads batches at a time, in parallel, so only the
+        // blocks about to be sent are held compressed
+        for (size_t first = 0; first < outgoing.size(); ) {
+            size_t last = first;
+            size_t bytes = 0;
+            while (last < outgoing.size() && (last == first || bytes < (size_t) threads * batch_bytes)) {
+                bytes += chunked->blocks[outgoing[last].block].size();
+                last++;
+            }
 
-		//log->info("Block stored in server {} with policy: \"{}\"", localServer, policy);
-		//log->info("Block stored in server {} with policy: \"{}\"", closestServer, policy);
+            vector<thread> packers;
+            for (int t = 1; t < threads && (size_t) t < last - first; t++) {
+                packers.push_back(thread([&, t]() {
+                    for (size_t o = first + t; o < last; o += threads) {
+                        pack(*chunked, outgoing[o]);
+                    }
+                }));
             }
-    
-            //--------------------------                                            
-            //-- localfarthest Policy --                                            
-            //--------------------------
-            
-            else if( policy == "localfarthest"){
-
-                (void)clients[localServer]->call("store_block", hash, block);
-                (void)clients[farthestServer]->call("store_block", hash, block);
-
-		//log->info("Block stored in server {} with policy: \"{}\"", localServer, policy);
-		//log->info("Block stored in server {} with policy: \"{}\"", farthestServer, policy);
+            for (size_t o = first; o < last; o += threads) {
+                pack(*chunked, outgoing[o]);
+            }
+            for (auto& packer : packers) {
+                packer.join();
             }
 
-            // Policy not handled
-            else{
-            
-                log->error("Policy {} not handled", policy);
+            for (size_t o = first; o < last; o++) {
+                for (auto& to : outgoing[o].to) {
+                    int n = to.second;
+                    store(n, coding[n] ? outgoing[o].coded[to.first] : outgoing[o].raw[to.first]);
+                }
+                outgoing[o].raw.clear();
+                outgoing[o].coded.clear();
             }
-        }                                                       
-        local_it++;                                                     
+            first = last;
+        }
+    }
+
+    log->info("Sending {} block bytes, all replicas, for {} bytes of files; {} repeated blocks skipped", sentBytes, totalBytes, repeats);
+
+    // Send whatever is left below the batch budget
+    for (int n = 0; n < num_servers; n++){
+        flush(n);
     }
 
+    // The upload is done once every block reached its quorum
+    size_t failed = acks.wait();
+
 	auto finishtime = std::chrono::high_resolution_clock::now();
 
         std::chrono::duration<double> elapsedtime = finishtime - starttime;
@@ -480,6 +917,31 @@ void Uploader::upload()
 
 	log->info("Upload time: {}", finaltime);
 
+    if (failed > 0) {
+        log->error("{} blocks could not be stored", failed);
+    }
+
+    // Let replicas beyond the quorum finish before disconnecting
+    for (int n = 0; n < num_servers; n++){
+        windows[n]->drain();
+    }
+    links->stop();
+
+    for (int n = 0; n < num_servers; n++){
+        log->info("Server {}: RTT {} ms (p50 {}, p99 {}), {} bytes/ms", n, links->rtt(n),
+                  links->rttPercentile(n, 50), links->rttPercentile(n, 99), links->bandwidth(n));
+    }
+
+    scanner.join();
+    reader.join();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+
+    if (unreadable > 0) {
+        log->error("{} files could not be read", unreadable.load());
+    }
 
     // Delete the clients
     for (int i = 0; i < num_servers; ++i)
@@ -487,4 +949,5 @@ void Uploader::upload()
         log->info("Tearing down client {}", i);
         delete clients[i];
     }
+    return failed == 0 && unreadable == 0;
 }
@@ -1,6 +1,8 @@
 #ifndef UPLOADER_HPP
 #define UPLOADER_HPP
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -8,35 +10,88 @@
 #include "rpc/client.h"
 
 #include "SurfStoreTypes.hpp"
+#include "BlockCodec.hpp"
+#include "BlockView.hpp"
+#include "Chunker.hpp"
+#include "HashRing.hpp"
+#include "LinkEstimator.hpp"
+#include "MappedFile.hpp"
+#include "Placement.hpp"
+#include "ReedSolomon.hpp"
+#include "SharedPayload.hpp"
 #include "logger.hpp"
 
 using namespace std;
 
+// A file on its way through the upload pipeline: mapped, cut into
+// blocks, and hashed and packed by one or more HashJobs
+struct ChunkedFile {
+	string name;
+	shared_ptr<MappedFile> file;
+	vector<BlockView> blocks;
+	vector<string> hashes;       // hex, filled in by the hash workers
+	atomic<size_t> unhashed;     // jobs still running
+
+	// Also from the hash workers: what each piece of a block (the block,
+	// or one of its ec(k,m) fragments) is stored under. Piece p of block
+	// i is at i * pieces + p. Fragments are encoded, and pieces packed,
+	// only as they are sent.
+	size_t pieces;
+	vector<string> keys;
+};
+
+// Blocks [first, last) of a file, hashed by one worker
+struct HashJob {
+	shared_ptr<ChunkedFile> file;
+	size_t first;
+	size_t last;
+};
+
 class Uploader {
 public:
     Uploader(INIReader& t_config);
 
-	void upload();
+	// False if some files could not be read or some blocks stored
+	bool upload();
 
-	// Parsing files
-	string getAllBytes(string fileName);
-	vector<string> getBlocks(string fileName);
+	// Parsing files: blocks are views into the mapped file, not copies
+	shared_ptr<MappedFile> mapFile(string fileName);
+	vector<BlockView> getBlocks(const shared_ptr<MappedFile>& file);
 
-	// Get Server Instances
-	int getLocalServer(vector<double> RTT);
-	int getClosestServer(vector<double> RTT, int locServer);
-	int getFarthestServer(vector<double> RTT, int locServer);
-	int getRandomServer(int takenServer);
+	// Which of hashes the server holds, queried in batch_bytes chunks
+	vector<bool> hasBlocks(rpc::client* client, const vector<string>& hashes);
 
 	const uint64_t RPC_TIMEOUT = 10000; // milliseconds
+	const size_t HASH_JOB_BYTES = 1 << 20; // blocks hashed per job
 
 protected:
+	// Sets up placement, and the ring for ring(r), over the given servers
+	// only; false, with error set, if the policy needs more of them
+	bool placeOver(const vector<int>& servers, string& error);
 
     INIReader& config;
 
 	string base_dir;
 	int blocksize;
 	string policy;
+	unique_ptr<ReedSolomon> erasure; // set for policy=ec(k,m)
+	unique_ptr<HashRing> ring;       // set for policy=ring(r)
+	int ring_replicas;
+	int vnodes;
+	unique_ptr<LinkEstimator> links;
+	unique_ptr<Placement> placement;
+	vector<int> placed_on; // server placement's server i stands for
+	string chunking;
+	unique_ptr<Chunker> chunker; // set for chunking=cdc
+	int batch_bytes;
+	bool skip_existing;
+	bool prefilter; // skip asking about hashes a server's filter rules out
+	int threads; // hash workers
+	int window;  // store_blocks calls in flight per server
+	int retries;
+	int quorum;  // replica acks a block needs, 0 for all
+	int probe_ms; // background RTT probes, 0 for none
+	BlockCodec::Level compression;
 
 	int num_servers;
 	vector<string> ssdhosts;
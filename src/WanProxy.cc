@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "rpc/config.h"
+#include "rpc/msgpack.hpp"
+
+#include "WanProxy.hpp"
+#include "logger.hpp"
+
+typedef chrono::duration<double, milli> Millis;
+
+// Linux's minimum retransmission timeout
+static const double RTO_MS = 200;
+
+const size_t WanProxy::SEGMENT_BYTES;
+const size_t WanProxy::MAX_QUEUED;
+
+//-----------------------------------------------------------------
+//----------------------------- Link ------------------------------
+//-----------------------------------------------------------------
+
+WanLink::WanLink(const LinkShape& t_shape, uint64_t seed)
+	: linkShape(t_shape), rng(seed)
+{
+	stats.bytes[UP] = stats.bytes[DOWN] = 0;
+}
+
+WanLink::Clock::time_point WanLink::schedule(Direction direction, size_t bytes)
+{
+	lock_guard<mutex> guard(lock);
+	Clock::time_point now = Clock::now();
+	stats.bytes[direction] += bytes;
+
+	// Sent once the bytes queued ahead of it have drained
+	Clock::time_point sent = max(drained[direction], now);
+	if (linkShape.mbps > 0) {
+		sent += chrono::duration_cast<Clock::duration>(Millis(bytes * 8 / (linkShape.mbps * 1000)));
+	}
+	drained[direction] = sent;
+
+	double delay = linkShape.rttMs / 2;
+	if (linkShape.jitterMs > 0) {
+		delay += uniform_real_distribution<double>(-linkShape.jitterMs, linkShape.jitterMs)(rng);
+	}
+	if (linkShape.loss > 0 && uniform_real_distribution<double>(0, 1)(rng) < linkShape.loss) {
+		delay += RTO_MS + linkShape.rttMs;
+	}
+	return sent + chrono::duration_cast<Clock::duration>(Millis(max(delay, 0.0)));
+}
+
+void WanLink::called(const string& method)
+{
+	lock_guard<mutex> guard(lock);
+	stats.calls[method]++;
+}
+
+WanLink::Stats WanLink::takeStats()
+{
+	lock_guard<mutex> guard(lock);
+	Stats taken = stats;
+	stats.bytes[UP] = stats.bytes[DOWN] = 0;
+	stats.calls.clear();
+	return taken;
+}
+
+//-----------------------------------------------------------------
+//----------------------------- Proxy -----------------------------
+//-----------------------------------------------------------------
+
+// A connected socket to host:port, or -1
+static int connectTo(const string& host, int port)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* found = nullptr;
+	if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &found) != 0) {
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo* a = found; a != nullptr && fd < 0; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(found);
+	return fd;
+}
+
+// Segments go out as soon as they are due, not coalesced by Nagle
+static void setNoDelay(int fd)
+{
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static bool sendAll(int fd, const string& bytes)
+{
+	size_t sent = 0;
+	while (sent < bytes.size()) {
+		ssize_t n = send(fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		sent += n;
+	}
+	return true;
+}
+
+WanProxy::WanProxy(int t_listenPort, const string& t_host, int t_port, const LinkShape& shape, uint64_t seed)
+	: listenPort(t_listenPort), host(t_host), port(t_port), link(shape, seed)
+{
+}
+
+void WanProxy::run()
+{
+	auto log = logger();
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(listenPort);
+	if (bind(listener, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(listener, 128) < 0) {
+		log->error("Unable to listen on port {}: {}", listenPort, strerror(errno));
+		close(listener);
+		return;
+	}
+
+	const LinkShape& shape = link.shape();
+	log->info("Proxying port {} to {}:{}: RTT {} ms, jitter {} ms, {} Mbit/s, loss {}",
+	          listenPort, host, port, shape.rttMs, shape.jitterMs, shape.mbps, shape.loss);
+
+	while (true) {
+		int client = accept(listener, nullptr, nullptr);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			log->error("Accepting on port {} failed: {}", listenPort, strerror(errno));
+			break;
+		}
+		thread(&WanProxy::serve, this, client).detach();
+	}
+	close(listener);
+}
+
+void WanProxy::serve(int client)
+{
+	auto log = logger();
+
+	// The handshake's round trip
+	this_thread::sleep_for(Millis(link.shape().rttMs));
+
+	int server = connectTo(host, port);
+	if (server < 0) {
+		log->error("Unable to connect to {}:{}: {}", host, port, strerror(errno));
+		close(client);
+		return;
+	}
+	setNoDelay(client);
+	setNoDelay(server);
+
+	thread up(&WanProxy::relay, this, client, server, WanLink::UP);
+	relay(server, client, WanLink::DOWN);
+	up.join();
+
+	close(client);
+	close(server);
+}
+
+// Bytes read from one side, due for delivery to the other at a time;
+// empty at the end of the stream
+struct Segment {
+	WanLink::Clock::time_point at;
+	string bytes;
+};
+
+void WanProxy::relay(int from, int to, WanLink::Direction direction)
+{
+	mutex lock;
+	condition_variable changed;
+	deque<Segment> queue;
+	size_t queued = 0;
+	bool failed = false;
+
+	thread writer([&]() {
+		while (true) {
+			Segment segment;
+			{
+				unique_lock<mutex> guard(lock);
+				changed.wait(guard, [&] { return !queue.empty(); });
+				segment = move(queue.front());
+				queue.pop_front();
+			}
+			this_thread::sleep_until(segment.at);
+
+			if (segment.bytes.empty()) {
+				shutdown(to, SHUT_WR);
+				return;
+			}
+			bool sent = sendAll(to, segment.bytes);
+			{
+				lock_guard<mutex> guard(lock);
+				queued -= segment.bytes.size();
+				failed = !sent;
+			}
+			changed.notify_all();
+			if (!sent) {
+				// The reader sees the end of its stream and stops
+				shutdown(from, SHUT_RD);
+				return;
+			}
+		}
+	});
+
+	// Requests are [0, id, method, params], notifications [2, method, params]
+	RPCLIB_MSGPACK::unpacker requests;
+	bool counting = direction == WanLink::UP;
+
+	vector<char> buffer(SEGMENT_BYTES);
+	WanLink::Clock::time_point last;
+	while (true) {
+		ssize_t got = recv(from, buffer.data(), buffer.size(), 0);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (counting && got > 0) {
+			try {
+				requests.reserve_buffer(got);
+				memcpy(requests.buffer(), buffer.data(), got);
+				requests.buffer_consumed(got);
+				RPCLIB_MSGPACK::object_handle message;
+				while (requests.next(message)) {
+					const RPCLIB_MSGPACK::object& o = message.get();
+					if (o.type == RPCLIB_MSGPACK::type::ARRAY && o.via.array.size >= 3
+					    && o.via.array.ptr[0].type == RPCLIB_MSGPACK::type::POSITIVE_INTEGER) {
+						const RPCLIB_MSGPACK::object& method = o.via.array.ptr[o.via.array.ptr[0].via.u64 == 0 ? 2 : 1];
+						if (method.type == RPCLIB_MSGPACK::type::STR) {
+							link.called(string(method.via.str.ptr, method.via.str.size));
+						}
+					}
+				}
+			} catch (std::exception&) {
+				// Not msgpack-rpc; relayed all the same
+				counting = false;
+			}
+		}
+
+		// In order, as over one TCP connection
+		Segment segment;
+		if (got > 0) {
+			segment.bytes.assign(buffer.data(), got);
+		}
+		segment.at = max(link.schedule(direction, segment.bytes.size()), last);
+		last = segment.at;
+
+		{
+			unique_lock<mutex> guard(lock);
+			changed.wait(guard, [&] { return failed || queued < MAX_QUEUED; });
+			if (failed) {
+				break;
+			}
+			queued += segment.bytes.size();
+			queue.push_back(move(segment));
+		}
+		changed.notify_all();
+		if (got <= 0) {
+			break;
+		}
+	}
+	writer.join();
+}
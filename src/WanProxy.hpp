@@ -0,0 +1,100 @@
+#ifndef WANPROXY_HPP
+#define WANPROXY_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+
+using namespace std;
+
+// How a wide-area link between two regions behaves
+struct LinkShape {
+	double rttMs;    // round trip time, half of it added each way
+	double jitterMs; // each segment's one-way delay varies uniformly by up to this
+	double mbps;     // bandwidth cap each way, 0 for none
+	double loss;     // fraction of segments lost
+};
+
+// The state of one emulated link: when each segment read from one side
+// is delivered to the other. A segment waits for the bytes queued ahead
+// of it to drain at the bandwidth cap, then for the one-way delay plus
+// jitter. A lost segment is delivered after a retransmission timeout
+// instead (the 200 ms Linux minimum plus a round trip), as TCP would.
+//
+// Every connection through a proxy shares its link, so they also share
+// its bandwidth. Jitter and loss come from a generator seeded per link,
+// so a run sees the same sequence of delays and losses each time.
+//
+// The link also counts the bytes it carries and the RPC calls clients
+// make over it, for benchmarks to read.
+class WanLink {
+public:
+	typedef chrono::steady_clock Clock;
+
+	enum Direction { UP, DOWN }; // client to server, server to client
+
+	struct Stats {
+		uint64_t bytes[2];
+		map<string, uint64_t> calls; // by method
+	};
+
+	WanLink(const LinkShape& t_shape, uint64_t seed);
+
+	// When a segment of bytes read now going in direction is delivered
+	Clock::time_point schedule(Direction direction, size_t bytes);
+
+	// A client called method
+	void called(const string& method);
+
+	// What was counted since the last takeStats()
+	Stats takeStats();
+
+	const LinkShape& shape() const {
+		return linkShape;
+	}
+
+protected:
+	LinkShape linkShape;
+	mutex lock;
+	mt19937_64 rng;
+	Clock::time_point drained[2]; // when the bytes queued each way are sent
+	Stats stats;
+};
+
+// User-space TCP proxy that accepts connections on listenPort and relays
+// each to host:port through a WanLink. A connection is set up after a
+// round trip, as the TCP handshake would be, and its segments are
+// delivered in order, so a lost one holds back those after it. Every
+// connection gets a reader and a writer thread per direction; a reader
+// stops reading while MAX_QUEUED bytes wait for delivery, like a full
+// socket buffer. The requests clients send are unpacked as msgpack-rpc
+// messages to count the calls.
+class WanProxy {
+public:
+	static const size_t SEGMENT_BYTES = 16 << 10;
+	static const size_t MAX_QUEUED = 4 << 20;
+
+	WanProxy(int t_listenPort, const string& t_host, int t_port, const LinkShape& shape, uint64_t seed);
+
+	// Accepts and relays connections; returns only if listening fails
+	void run();
+
+	WanLink& getLink() {
+		return link;
+	}
+
+protected:
+	void serve(int client);
+	void relay(int from, int to, WanLink::Direction direction);
+
+	int listenPort;
+	string host;
+	int port;
+	WanLink link;
+};
+
+#endif // WANPROXY_HPP
@@ -0,0 +1,229 @@
+#!/bin/bash
+# Runs the uploader and downloader over every combination of placement
+# policy, block size, file mix and client region, on a cluster on this
+# machine behind wanproxy (see wan-cluster.sh). Each combination runs
+# trials times, each time against freshly started, empty servers.
+#
+#   bench-sweep.sh [-c config_file] [-o out_dir] [-n trials] [-p policies]
+#                  [-b block_sizes] [-m mixes] [-r regions]
+#
+# Lists are space separated. Mixes are small (256 files of 4-64 KiB),
+# mixed (32 files of 1 KiB-4 MiB) and large (4 files of 16 MiB); each is
+# made once per sweep, so every combination moves the same bytes. The
+# defaults run the five policies of the report with 4 KiB blocks on the
+# mixed files from each of the four regions, 5 times each.
+#
+# Writes to out_dir:
+#   trials.csv    one row per trial
+#   summary.csv   per combination and metric, over the trials that
+#                 succeeded: n, mean, stddev, min, p50, p90, p99, max and
+#                 a 95% confidence interval of the mean
+#   summary.json  the same as JSON
+#   failed/       the logs of trials that failed
+#
+# Metrics: upload_s and download_s are the times the clients log;
+# *_wall_s the whole runs, connecting and locating included. bytes_up
+# is what the client sent to the servers, bytes_down what it got back,
+# and calls the RPCs it made, counted by the proxy.
+
+bin=$(cd "$(dirname "$0")" && pwd)
+
+config=$bin/myconfig.ini
+out=sweep-$(date +%Y%m%d-%H%M%S)
+trials=5
+policies="random tworandom local localclosest localfarthest"
+block_sizes="4096"
+mixes="mixed"
+regions="seoul dublin saopaulo mumbai"
+
+while getopts "c:o:n:p:b:m:r:" opt; do
+	case $opt in
+		c) config=$OPTARG ;;
+		o) out=$OPTARG ;;
+		n) trials=$OPTARG ;;
+		p) policies=$OPTARG ;;
+		b) block_sizes=$OPTARG ;;
+		m) mixes=$OPTARG ;;
+		r) regions=$OPTARG ;;
+		*)
+			echo "Usage: $0 [-c config_file] [-o out_dir] [-n trials] [-p policies] [-b block_sizes] [-m mixes] [-r regions]" >&2
+			exit 64
+			;;
+	esac
+done
+
+# ini_set <file> <section> <key> <value>: sets key, adding it if missing
+ini_set() {
+	awk -v section="[$2]" -v key="$3" -v value="$4" '
+		/^\[/ {
+			if (inside && !done) { print key "=" value; done = 1 }
+			inside = ($0 == section)
+		}
+		inside && index($0, key "=") == 1 {
+			if (!done) print key "=" value
+			done = 1
+			next
+		}
+		{ print }
+		END { if (inside && !done) print key "=" value }' "$1" > "$1.tmp" && mv "$1.tmp" "$1"
+}
+
+# make_mix <name> <dir>
+make_mix() {
+	local name=$1 dir=$2 i
+	mkdir -p "$dir"
+	case $name in
+		small) for ((i = 0; i < 256; i++)); do head -c $((4096 * (1 + i % 16))) /dev/urandom > "$dir/f$i"; done ;;
+		mixed) for ((i = 0; i < 32; i++)); do head -c $((1024 << (i % 13))) /dev/urandom > "$dir/f$i"; done ;;
+		large) for ((i = 0; i < 4; i++)); do head -c $((16 << 20)) /dev/urandom > "$dir/f$i"; done ;;
+		*) echo "Unknown file mix $name" >&2; exit 64 ;;
+	esac
+}
+
+# The number a client logged after label, or empty
+logged() {
+	sed -n -E "s/.*$2: ([0-9.e+-]+).*/\1/p" "$1" | tail -1
+}
+
+now() {
+	date +%s.%N
+}
+
+# Seconds since start
+since() {
+	awk -v start="$1" -v end="$(now)" 'BEGIN { printf "%.6f", end - start }'
+}
+
+mkdir -p "$out/work" "$out/failed"
+work=$(cd "$out/work" && pwd)
+for mix in $mixes; do
+	make_mix "$mix" "$work/mix-$mix"
+done
+
+# Tab separated as it runs, since policies like ec(2,2) hold commas
+rows=$work/trials.tsv
+: > "$rows"
+metrics="upload_s upload_wall_s upload_bytes_up upload_bytes_down upload_calls download_s download_wall_s download_bytes_up download_bytes_down download_calls"
+
+for policy in $policies; do
+for block_size in $block_sizes; do
+for mix in $mixes; do
+for region in $regions; do
+	for ((trial = 1; trial <= trials; trial++)); do
+		name="$policy $block_size $mix $region #$trial"
+		cfg=$work/trial.ini
+		cp "$config" "$cfg"
+		ini_set "$cfg" uploader policy "$policy"
+		ini_set "$cfg" uploader blocksize "$block_size"
+		ini_set "$cfg" uploader base_dir "$work/mix-$mix"
+		ini_set "$cfg" downloader blocksize "$block_size"
+		ini_set "$cfg" downloader base_dir "$work/down"
+		ini_set "$cfg" downloader cache_dir ""
+		rm -rf "$work/down" "$work/cluster"
+		mkdir -p "$work/down"
+
+		if ! "$bin/wan-cluster.sh" start "$cfg" "$region" "$work/cluster" > /dev/null; then
+			echo "$name: cluster did not start" >&2
+			exit 69
+		fi
+
+		start=$(now)
+		timeout 600 "$bin/uploader" "$work/cluster/client.ini" > "$work/up.log" 2>&1
+		up_rc=$?
+		up_wall=$(since "$start")
+		read -r up_bytes_up up_bytes_down up_calls < <("$bin/wan-cluster.sh" stats "$work/cluster")
+
+		start=$(now)
+		timeout 600 "$bin/downloader" "$work/cluster/client.ini" > "$work/down.log" 2>&1
+		down_rc=$?
+		down_wall=$(since "$start")
+		read -r down_bytes_up down_bytes_down down_calls < <("$bin/wan-cluster.sh" stats "$work/cluster")
+
+		"$bin/wan-cluster.sh" stop "$work/cluster"
+
+		ok=1
+		if [ $up_rc != 0 ] || [ $down_rc != 0 ] || ! diff -rq "$work/mix-$mix" "$work/down" > /dev/null; then
+			ok=0
+			failed="$out/failed/$(echo "$policy-$block_size-$mix-$region-$trial" | tr -c 'A-Za-z0-9.-' '_')"
+			mkdir -p "$failed"
+			cp "$work/up.log" "$work/down.log" "$work/cluster/"*.log "$failed/"
+		fi
+
+		up_s=$(logged "$work/up.log" "Upload time")
+		down_s=$(logged "$work/down.log" "Download time")
+		printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+			"$policy" "$block_size" "$mix" "$region" "$trial" "$ok" \
+			"$up_s" "$up_wall" "$up_bytes_up" "$up_bytes_down" "$up_calls" \
+			"$down_s" "$down_wall" "$down_bytes_up" "$down_bytes_down" "$down_calls" >> "$rows"
+		echo "$name: $([ $ok = 1 ] && echo ok || echo FAILED), upload ${up_s}s, download ${down_s}s"
+	done
+done
+done
+done
+done
+
+# Raw trials as CSV, quoting the policy
+{
+	echo "policy,block_size,mix,region,trial,ok,${metrics// /,}"
+	awk -F'\t' -v OFS=, '{ $1 = "\"" $1 "\""; print }' "$rows"
+} > "$out/trials.csv"
+
+# Summaries of each combination and metric over its successful trials
+awk -F'\t' -v metric_names="$metrics" -v csv="$out/summary.csv" -v json="$out/summary.json" '
+	# Two-sided 95% t quantiles by degrees of freedom; 1.96 past 30
+	function t95(df) {
+		split("12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 2.228 2.201 2.179 2.160 2.145 2.131 2.120 2.110 2.101 2.093 2.086 2.080 2.074 2.069 2.064 2.060 2.056 2.052 2.048 2.045 2.042", t, " ")
+		return df <= 30 ? t[df] : 1.960
+	}
+	# Linear interpolation between the closest ranks of sorted v[1..n]
+	function percentile(v, n, p,    r, lo) {
+		r = 1 + (n - 1) * p / 100
+		lo = int(r)
+		return lo >= n ? v[n] : v[lo] + (r - lo) * (v[lo + 1] - v[lo])
+	}
+	BEGIN {
+		m = split(metric_names, names, " ")
+		print "policy,block_size,mix,region,metric,n,mean,stddev,min,p50,p90,p99,max,ci95_low,ci95_high" > csv
+		printf "[" > json
+	}
+	$6 == 1 {
+		key = $1 "\t" $2 "\t" $3 "\t" $4
+		if (!(key in count)) order[++keys] = key
+		c = ++count[key]
+		for (i = 1; i <= m; i++) value[key, i, c] = $(6 + i)
+	}
+	END {
+		first = 1
+		for (k = 1; k <= keys; k++) {
+			key = order[k]
+			split(key, f, "\t")
+			n = count[key]
+			for (i = 1; i <= m; i++) {
+				# Insertion sort; trials are few
+				sum = 0
+				for (j = 1; j <= n; j++) {
+					x = value[key, i, j] + 0
+					sum += x
+					for (l = j - 1; l >= 1 && v[l] > x; l--) v[l + 1] = v[l]
+					v[l + 1] = x
+				}
+				mean = sum / n
+				ss = 0
+				for (j = 1; j <= n; j++) ss += (v[j] - mean) ^ 2
+				sd = n > 1 ? sqrt(ss / (n - 1)) : 0
+				half = n > 1 ? t95(n - 1) * sd / sqrt(n) : 0
+				p50 = percentile(v, n, 50); p90 = percentile(v, n, 90); p99 = percentile(v, n, 99)
+
+				printf "\"%s\",%s,%s,%s,%s,%d,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g\n",
+					f[1], f[2], f[3], f[4], names[i], n, mean, sd, v[1], p50, p90, p99, v[n],
+					mean - half, mean + half > csv
+				printf "%s\n  {\"policy\": \"%s\", \"block_size\": %s, \"mix\": \"%s\", \"region\": \"%s\", \"metric\": \"%s\", \"n\": %d, \"mean\": %.10g, \"stddev\": %.10g, \"min\": %.10g, \"p50\": %.10g, \"p90\": %.10g, \"p99\": %.10g, \"max\": %.10g, \"ci95_low\": %.10g, \"ci95_high\": %.10g}",
+					first ? "" : ",", f[1], f[2], f[3], f[4], names[i], n, mean, sd, v[1], p50, p90, p99, v[n],
+					mean - half, mean + half > json
+				first = 0
+			}
+		}
+		print "\n]" > json
+	}' "$rows"
+
+echo "Wrote $out/trials.csv, $out/summary.csv and $out/summary.json"
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "picosha2/picosha2.h"
+
+#include "BlockStore.hpp"
+
+using namespace std;
+
+// Measures BlockStore throughput for a get-heavy mix (90% get_block,
+// 10% store_block) at 1, 2, 4, 8 and 16 threads, comparing a single
+// lock (the old single map) with the default striped layout.
+
+static const int NUM_KEYS = 8192;
+static const int BLOCK_SIZE = 4096;
+
+static uint64_t xorshift(uint64_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static double runTrial(BlockStore& store, const vector<BlockDigest>& keys,
+	const string& block, int numthreads, long opsPerThread)
+{
+	vector<thread> workers;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (int t = 0; t < numthreads; ++t) {
+		workers.push_back(thread([&, t]() {
+			uint64_t state = 0x9e3779b97f4a7c15ULL * (t + 1);
+			string out;
+
+			for (long i = 0; i < opsPerThread; ++i) {
+				uint64_t r = xorshift(state);
+				const BlockDigest& key = keys[r % keys.size()];
+
+				if ((r >> 32) % 10 == 0) {
+					store.put(key, block);
+				} else {
+					store.get(key, out);
+				}
+			}
+		}));
+	}
+	for (auto& w : workers) {
+		w.join();
+	}
+
+	auto finish = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> elapsed = finish - start;
+
+	return (numthreads * opsPerThread) / elapsed.count();
+}
+
+int main(int argc, char** argv) {
+	long opsPerThread = 200000;
+
+	if (argc > 1) {
+		opsPerThread = strtol(argv[1], NULL, 10);
+	}
+	if (opsPerThread <= 0) {
+		cerr << "Usage: " << argv[0] << " [ops_per_thread]" << endl;
+		return 1;
+	}
+
+	vector<BlockDigest> keys;
+	for (int i = 0; i < NUM_KEYS; ++i) {
+		BlockDigest digest;
+		string name = "block-" + std::to_string(i);
+		picosha2::hash256(name.begin(), name.end(), digest.bytes, digest.bytes + BlockDigest::SIZE);
+		keys.push_back(digest);
+	}
+	string block(BLOCK_SIZE, 'x');
+
+	size_t layouts[] = { 1, BlockStore::DEFAULT_SHARDS };
+	int threadCounts[] = { 1, 2, 4, 8, 16 };
+
+	cout << "hardware threads: " << thread::hardware_concurrency() << endl;
+	cout << "shards\tthreads\tops/sec" << endl;
+
+	for (size_t shards : layouts) {
+		BlockStore store(shards);
+		for (auto& k : keys) {
+			store.put(k, block);
+		}
+
+		for (int numthreads : threadCounts) {
+			double rate = runTrial(store, keys, block, numthreads, opsPerThread);
+			cout << shards << "\t" << numthreads << "\t" << (long) rate << endl;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <set>
+#include <chrono>
+#include <functional>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "Chunker.hpp"
+
+using namespace std;
+
+// Measures Chunker throughput on random data and how many chunks survive
+// a one-byte insertion at the front of the buffer.
+
+static vector<size_t> chunkSizes(const Chunker& chunker, const string& data)
+{
+	vector<size_t> sizes;
+	const unsigned char* p = (const unsigned char*) data.data();
+
+	for (size_t start = 0; start < data.size(); ) {
+		size_t len = chunker.nextChunk(p + start, data.size() - start);
+		sizes.push_back(len);
+		start += len;
+	}
+	return sizes;
+}
+
+static set<size_t> chunkHashes(const string& data, const vector<size_t>& sizes)
+{
+	set<size_t> hashes;
+	size_t start = 0;
+
+	for (size_t len : sizes) {
+		hashes.insert(std::hash<string>()(data.substr(start, len)));
+		start += len;
+	}
+	return hashes;
+}
+
+int main(int argc, char** argv) {
+	size_t avg = 4096;
+	size_t megabytes = 256;
+
+	if (argc > 1) {
+		avg = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		megabytes = strtoul(argv[2], NULL, 10);
+	}
+	if (avg < 64 || megabytes == 0) {
+		cerr << "Usage: " << argv[0] << " [avg_chunk] [megabytes]" << endl;
+		return 1;
+	}
+
+	string data(megabytes << 20, '\0');
+	uint64_t state = 88172645463325252ULL;
+	for (size_t i = 0; i < data.size(); ++i) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		data[i] = (char) state;
+	}
+
+	Chunker chunker(avg / 4, avg, avg * 4);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	vector<size_t> sizes = chunkSizes(chunker, data);
+	auto finish = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> elapsed = finish - start;
+
+	cout << "chunks: " << sizes.size() << endl;
+	cout << "mean chunk bytes: " << data.size() / sizes.size() << endl;
+	cout << "throughput GB/s: " << data.size() / elapsed.count() / 1e9 << endl;
+
+	// Insert one byte up front and count chunks that are unchanged
+	string edited = "!" + data.substr(0, 64 << 20);
+	string original = data.substr(0, 64 << 20);
+	set<size_t> before = chunkHashes(original, chunkSizes(chunker, original));
+	set<size_t> after = chunkHashes(edited, chunkSizes(chunker, edited));
+
+	size_t shared = 0;
+	for (size_t h : after) {
+		shared += before.count(h);
+	}
+	cout << "chunks unchanged after 1-byte insert: " << shared << " of " << after.size() << endl;
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "BlockCodec.hpp"
+
+using namespace std;
+
+// Compresses each file given, cut into fixed-size blocks, at every level
+// and reports how many blocks were sent compressed, the bytes saved and
+// the throughput. Every compressed block is decoded again, inside the
+// timed loop, and compared with the original.
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		cerr << "Usage: " << argv[0] << " block_bytes file..." << endl;
+		return 1;
+	}
+	size_t blocksize = strtoul(argv[1], NULL, 10);
+	if (blocksize == 0) {
+		cerr << "Usage: " << argv[0] << " block_bytes file..." << endl;
+		return 1;
+	}
+
+	int failed = 0;
+	for (int arg = 2; arg < argc; ++arg) {
+		ifstream in(argv[arg], ios::binary);
+		if (!in) {
+			cerr << argv[arg] << ": cannot open" << endl;
+			return 1;
+		}
+		stringstream contents;
+		contents << in.rdbuf();
+		string data = contents.str();
+
+		for (BlockCodec::Level level : { BlockCodec::FAST, BlockCodec::HIGH }) {
+			size_t blocks = 0;
+			size_t compressed = 0;
+			size_t sent = 0;
+			string out;
+			string back;
+
+			auto start = std::chrono::high_resolution_clock::now();
+			for (size_t offset = 0; offset < data.size(); offset += blocksize) {
+				size_t len = min(blocksize, data.size() - offset);
+				++blocks;
+				if (!BlockCodec::compress(data.data() + offset, len, level, out)) {
+					sent += len;
+					continue;
+				}
+				++compressed;
+				sent += out.size();
+				if (!BlockCodec::decompress(BlockCodec::CODEC_LZ4, out.data(), out.size(), back) ||
+				    back.compare(0, string::npos, data, offset, len) != 0) {
+					++failed;
+				}
+			}
+			auto finish = std::chrono::high_resolution_clock::now();
+			std::chrono::duration<double> elapsed = finish - start;
+
+			cout << argv[arg] << " " << (level == BlockCodec::FAST ? "lz4" : "lz4hc") << ": "
+			     << compressed << "/" << blocks << " blocks compressed, "
+			     << data.size() << " -> " << sent << " bytes, "
+			     << data.size() / elapsed.count() / 1e6 << " MB/s" << endl;
+		}
+	}
+	if (failed) {
+		cout << failed << " blocks did not round trip" << endl;
+	}
+	return failed ? 1 : 0;
+}
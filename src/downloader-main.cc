@@ -30,7 +30,9 @@ int main(int argc, char** argv) {
 	}
 
 	Downloader c(config);
-	c.download();
+	if (!c.download()) {
+		return EX_UNAVAILABLE;
+	}
 
 	return 0;
 } 
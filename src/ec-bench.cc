@@ -0,0 +1,168 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ReedSolomon.hpp"
+
+using namespace std;
+
+// Compares ec(k,m) with tworandom. Runs the GF(2^8) kernel self tests
+// and measures each backend, then encode and worst-case decode (the
+// first m data fragments lost) on 4 KiB blocks, and the bytes stored
+// per block byte under each policy.
+//
+// Given the average RTT to each server in ms, as the downloader logs
+// them, it also models the latency of fetching one block: tworandom
+// asks the faster of the block's two replicas, ec(k,m) asks the k + 1
+// fastest fragment holders and waits for the first k. Each reply takes
+// its server's RTT times 1 + an exponential jitter of mean 0.2.
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double seconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		cerr << "Usage: " << argv[0] << " k m [rtt_ms ...]" << endl;
+		return 1;
+	}
+	int k = atoi(argv[1]);
+	int m = atoi(argv[2]);
+	if (k < 1 || m < 1 || k + m > ReedSolomon::MAX_FRAGMENTS) {
+		cerr << "Usage: " << argv[0] << " k m [rtt_ms ...]" << endl;
+		return 1;
+	}
+	vector<double> rtt;
+	for (int i = 3; i < argc; ++i) {
+		rtt.push_back(atof(argv[i]));
+	}
+
+	mt19937_64 rng(88172645463325252ULL);
+	int failed = 0;
+
+	// Kernel
+	const size_t bytes = 64 << 20;
+	vector<uint8_t> src(bytes), dst(bytes);
+	for (auto& b : src) {
+		b = (uint8_t) rng();
+	}
+	cout << "default backend: " << ReedSolomon::name(ReedSolomon::backend()) << endl;
+
+	for (ReedSolomon::Backend backend : { ReedSolomon::SCALAR, ReedSolomon::SSSE3, ReedSolomon::AVX2 }) {
+		if (!ReedSolomon::supported(backend)) {
+			cout << ReedSolomon::name(backend) << ": not supported" << endl;
+			continue;
+		}
+		if (!ReedSolomon::selfTest(backend)) {
+			cout << ReedSolomon::name(backend) << ": SELF TEST FAILED" << endl;
+			++failed;
+			continue;
+		}
+		auto start = Clock::now();
+		ReedSolomon::mulAdd(backend, dst.data(), src.data(), 0x8e, bytes);
+		cout << ReedSolomon::name(backend) << ": self test ok, "
+		     << bytes / seconds(start) / 1e9 << " GB/s multiply-add" << endl;
+	}
+
+	// Encode and decode
+	ReedSolomon code(k, m);
+	const size_t blocksize = 4096;
+	const size_t count = (bytes / 4) / blocksize;
+
+	auto start = Clock::now();
+	vector<vector<string>> encoded(count);
+	for (size_t i = 0; i < count; ++i) {
+		encoded[i] = code.encode((const char*) src.data() + i * blocksize, blocksize);
+	}
+	double encodeTime = seconds(start);
+
+	// Keep the last k fragments: as many data fragments lost as possible
+	vector<int> indexes;
+	for (int f = code.fragments() - k; f < code.fragments(); ++f) {
+		indexes.push_back(f);
+	}
+	start = Clock::now();
+	string block;
+	for (size_t i = 0; i < count; ++i) {
+		vector<const string*> fragments;
+		for (int f : indexes) {
+			fragments.push_back(&encoded[i][f]);
+		}
+		if (!code.decode(indexes, fragments, block)
+			|| block.compare(0, string::npos, (const char*) src.data() + i * blocksize, blocksize) != 0) {
+			++failed;
+		}
+	}
+	double decodeTime = seconds(start);
+
+	cout << code.name() << ": encode " << count * blocksize / encodeTime / 1e6 << " MB/s, "
+	     << "decode " << count * blocksize / decodeTime / 1e6 << " MB/s" << endl;
+
+	// Storage
+	double stored = (double) code.fragments() * encoded[0][0].size() / blocksize;
+	cout << "stored per block byte: " << code.name() << " " << stored << ", tworandom 2" << endl;
+
+	// Modelled fetch latency
+	int servers = rtt.size();
+	if (servers > 0 && code.fragments() > servers) {
+		cout << code.name() << " needs " << code.fragments() << " servers" << endl;
+	}
+	else if (servers >= 2) {
+		const int trials = 100000;
+		exponential_distribution<double> jitter(5.0);
+		uniform_int_distribution<int> pick(0, servers - 1);
+		vector<double> replicated, coded;
+
+		for (int t = 0; t < trials; ++t) {
+			vector<double> took(servers);
+			for (int s = 0; s < servers; ++s) {
+				took[s] = rtt[s] * (1 + jitter(rng));
+			}
+
+			int a = pick(rng);
+			int b = pick(rng);
+			while (b == a) {
+				b = pick(rng);
+			}
+			replicated.push_back(took[rtt[a] <= rtt[b] ? a : b]);
+
+			int first = pick(rng);
+			vector<int> holders;
+			for (int f = 0; f < code.fragments(); ++f) {
+				holders.push_back((first + f) % servers);
+			}
+			sort(holders.begin(), holders.end(), [&](int x, int y) { return rtt[x] < rtt[y]; });
+			holders.resize(min(code.fragments(), k + 1));
+			vector<double> arrivals;
+			for (int s : holders) {
+				arrivals.push_back(took[s]);
+			}
+			sort(arrivals.begin(), arrivals.end());
+			coded.push_back(arrivals[k - 1]);
+		}
+
+		for (auto policy : { make_pair(string("tworandom"), &replicated), make_pair(code.name(), &coded) }) {
+			vector<double>& samples = *policy.second;
+			sort(samples.begin(), samples.end());
+			double mean = 0;
+			for (double x : samples) {
+				mean += x / samples.size();
+			}
+			cout << policy.first << " block fetch: mean " << mean << " ms, p99 "
+			     << samples[samples.size() * 99 / 100] << " ms" << endl;
+		}
+	}
+
+	if (failed) {
+		cout << failed << " failures" << endl;
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,116 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "Placement.hpp"
+
+using namespace std;
+
+// Measures every placement policy on random block hashes: blocks placed
+// per second when a file's blocks are placed as one batch and when they
+// are placed one at a time, and how evenly each server's share comes out
+// against the ideal width/servers of all replicas. Checks that no block
+// is given the same server twice.
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double seconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+	int servers = argc > 1 ? atoi(argv[1]) : 4;
+	size_t batch = argc > 2 ? atoi(argv[2]) : 1024;
+	if (servers < 2 || batch < 1) {
+		cerr << "Usage: " << argv[0] << " [servers [batch]]" << endl;
+		return 1;
+	}
+
+	mt19937_64 rng(88172645463325252ULL);
+	const size_t blocks = 1 << 20;
+	vector<BlockDigest> digests(blocks);
+	for (auto& digest : digests) {
+		for (auto& b : digest.bytes) {
+			b = (uint8_t) rng();
+		}
+	}
+
+	// A fixed RTT order stands in for the link estimator
+	vector<int> byRtt;
+	for (int s = 0; s < servers; s++) {
+		byRtt.push_back(s);
+	}
+	Placement::ServerOrder order = [&]() { return byRtt; };
+
+	vector<string> names;
+	for (int s = 0; s < servers; s++) {
+		names.push_back("server" + to_string(s) + ":" + to_string(8080 + s));
+	}
+	HashRing ring(names, vector<string>(), HashRing::DEFAULT_VNODES);
+
+	vector<string> policies = { "random", "tworandom", "local", "localclosest", "localfarthest", "ring(2)" };
+	if (servers >= 3) {
+		policies.push_back("ec(2,1)");
+	}
+	int failed = 0;
+
+	for (const string& policy : policies) {
+		string error;
+		unique_ptr<Placement> placement = Placement::create(policy, servers, order, &ring, error);
+		if (!placement) {
+			cerr << policy << ": " << error << endl;
+			failed++;
+			continue;
+		}
+		int width = placement->width();
+		vector<int> out(blocks * width);
+
+		auto start = Clock::now();
+		for (size_t first = 0; first < blocks; first += batch) {
+			size_t count = min(batch, blocks - first);
+			placement->place(&digests[first], count, &out[first * width]);
+		}
+		double batched = seconds(start);
+
+		vector<int> single(blocks * width);
+		start = Clock::now();
+		for (size_t i = 0; i < blocks; i++) {
+			placement->place(&digests[i], 1, &single[i * width]);
+		}
+		double oneByOne = seconds(start);
+
+		vector<size_t> load(servers, 0);
+		size_t repeated = 0;
+		for (size_t i = 0; i < blocks; i++) {
+			const int* chosen = &out[i * width];
+			for (int r = 0; r < width; r++) {
+				load[chosen[r]]++;
+				repeated += find(chosen, chosen + r, chosen[r]) != chosen + r;
+			}
+		}
+		if (repeated) {
+			failed++;
+		}
+
+		double ideal = (double) blocks * width / servers;
+		auto extremes = minmax_element(load.begin(), load.end());
+		cout << policy << ": " << blocks / batched / 1e6 << " M blocks/s in batches of " << batch << ", "
+		     << blocks / oneByOne / 1e6 << " M/s one at a time; per server min " << *extremes.first / ideal
+		     << ", max " << *extremes.second / ideal << " of the ideal"
+		     << (repeated ? ", SERVERS REPEATED" : "") << endl;
+	}
+
+	string error;
+	if (Placement::create("nosuchpolicy", servers, order, &ring, error)) {
+		cerr << "nosuchpolicy was accepted" << endl;
+		failed++;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "HashRing.hpp"
+
+using namespace std;
+
+// Measures the ring(r) policy on random block hashes: how evenly the
+// replicas spread over the servers, how many blocks change servers when
+// one server is added (ideally 1/(N+1) of them), lookups per second, and
+// that replicas land in distinct zones when servers are given two zones.
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double seconds(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static vector<string> serverNames(int servers)
+{
+	vector<string> names;
+	for (int s = 0; s < servers; s++) {
+		names.push_back("server" + to_string(s) + ":" + to_string(8080 + s));
+	}
+	return names;
+}
+
+int main(int argc, char** argv) {
+	int servers = argc > 1 ? atoi(argv[1]) : 4;
+	int vnodes = argc > 2 ? atoi(argv[2]) : HashRing::DEFAULT_VNODES;
+	int replicas = argc > 3 ? atoi(argv[3]) : 2;
+	if (servers < 1 || vnodes < 1 || replicas < 1 || replicas > servers) {
+		cerr << "Usage: " << argv[0] << " [servers [vnodes [replicas]]]" << endl;
+		return 1;
+	}
+
+	mt19937_64 rng(88172645463325252ULL);
+	const size_t blocks = 1 << 20;
+	vector<BlockDigest> digests(blocks);
+	for (auto& digest : digests) {
+		for (auto& b : digest.bytes) {
+			b = (uint8_t) rng();
+		}
+	}
+
+	auto built = Clock::now();
+	HashRing ring(serverNames(servers), vector<string>(), vnodes);
+	cout << servers << " servers, " << vnodes << " vnodes, " << replicas << " replicas: ring built in "
+	     << seconds(built) * 1000 << " ms" << endl;
+
+	// Balance
+	vector<size_t> load(servers, 0);
+	auto start = Clock::now();
+	for (auto& digest : digests) {
+		for (int s : ring.replicas(digest, replicas)) {
+			load[s]++;
+		}
+	}
+	double elapsed = seconds(start);
+	double ideal = (double) blocks * replicas / servers;
+	auto extremes = minmax_element(load.begin(), load.end());
+	cout << "lookups: " << blocks / elapsed / 1e6 << " M/s" << endl;
+	cout << "replicas per server: min " << *extremes.first / ideal << ", max " << *extremes.second / ideal
+	     << " of the ideal " << (size_t) ideal << endl;
+
+	// Movement when a server is added
+	HashRing grown(serverNames(servers + 1), vector<string>(), vnodes);
+	size_t moved = 0;
+	for (auto& digest : digests) {
+		vector<int> before = ring.replicas(digest, replicas);
+		vector<int> after = grown.replicas(digest, replicas);
+		for (int s : after) {
+			moved += find(before.begin(), before.end(), s) == before.end();
+		}
+	}
+	cout << "adding a server moves " << 100.0 * moved / (blocks * replicas) << "% of replicas (ideal "
+	     << 100.0 / (servers + 1) << "%)" << endl;
+
+	// Zones: servers alternate between two, so replicas should too
+	vector<string> zones;
+	for (int s = 0; s < servers; s++) {
+		zones.push_back(s % 2 ? "b" : "a");
+	}
+	HashRing zoned(serverNames(servers), zones, vnodes);
+	size_t spread = 0;
+	for (auto& digest : digests) {
+		vector<int> chosen = zoned.replicas(digest, replicas);
+		bool a = false, b = false;
+		for (int s : chosen) {
+			(s % 2 ? b : a) = true;
+		}
+		spread += a && b;
+	}
+	cout << "with two zones, " << 100.0 * spread / blocks << "% of blocks span both" << endl;
+
+	return 0;
+}
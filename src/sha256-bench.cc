@@ -0,0 +1,70 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "Sha256.hpp"
+
+using namespace std;
+
+// Runs the self test of each SHA-256 backend this CPU supports and
+// measures its throughput hashing a buffer cut into fixed-size blocks.
+
+int main(int argc, char** argv) {
+	size_t blocksize = 4096;
+	size_t megabytes = 256;
+
+	if (argc > 1) {
+		blocksize = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		megabytes = strtoul(argv[2], NULL, 10);
+	}
+	if (blocksize == 0 || megabytes == 0) {
+		cerr << "Usage: " << argv[0] << " [block_bytes] [megabytes]" << endl;
+		return 1;
+	}
+
+	string data(megabytes << 20, '\0');
+	uint64_t state = 88172645463325252ULL;
+	for (size_t i = 0; i < data.size(); ++i) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		data[i] = (char) state;
+	}
+
+	vector<const unsigned char*> blocks;
+	vector<size_t> lens;
+	for (size_t start = 0; start < data.size(); start += blocksize) {
+		blocks.push_back((const unsigned char*) data.data() + start);
+		lens.push_back(min(blocksize, data.size() - start));
+	}
+	vector<uint8_t> out(blocks.size() * Sha256::SIZE);
+
+	int failed = 0;
+	cout << "default backend: " << Sha256::name(Sha256::backend()) << endl;
+
+	for (Sha256::Backend backend : { Sha256::SCALAR, Sha256::SHANI, Sha256::AVX2 }) {
+		if (!Sha256::supported(backend)) {
+			cout << Sha256::name(backend) << ": not supported" << endl;
+			continue;
+		}
+		if (!Sha256::selfTest(backend)) {
+			cout << Sha256::name(backend) << ": SELF TEST FAILED" << endl;
+			++failed;
+			continue;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		Sha256::hashMany(backend, blocks.size(), blocks.data(), lens.data(), out.data());
+		auto finish = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double> elapsed = finish - start;
+
+		cout << Sha256::name(backend) << ": self test ok, "
+		     << data.size() / elapsed.count() / 1e9 << " GB/s" << endl;
+	}
+	return failed ? 1 : 0;
+}
@@ -33,7 +33,9 @@ int main(int argc, char** argv) {
 	}
 
 	Uploader c(config);
-	c.upload();
+	if (!c.upload()) {
+		return EX_UNAVAILABLE;
+	}
 
 	return 0;
 } 
@@ -0,0 +1,134 @@
+#!/bin/bash
+# Runs the ssd servers of a config on this machine behind wanproxy, which
+# delays each server's traffic as the link between the client's region
+# and the server's region would ([wan] in the config).
+#
+#   wan-cluster.sh start <config_file> <client_region> <dir>
+#   wan-cluster.sh stats <dir>
+#   wan-cluster.sh stop <dir>
+#
+# start writes <dir>/server.ini, with server N on localhost at
+# server_port + N, and <dir>/client.ini, with server N at its proxy on
+# proxy_port + N; run the uploader and downloader with client.ini. The
+# servers' and the proxy's logs and pids are kept in <dir>.
+#
+# stats prints the bytes sent up to the servers, the bytes sent back and
+# the RPC calls made since the last stats, and logs them per link in
+# <dir>/wanproxy.log.
+
+bin=$(cd "$(dirname "$0")" && pwd)
+
+# ini_get <file> <section> <key> <default>
+ini_get() {
+	awk -v section="[$2]" -v key="$3" -v value="$4" '
+		/^\[/ { inside = ($0 == section) }
+		inside && index($0, key "=") == 1 { value = substr($0, length(key) + 2) }
+		END { print value }' "$1"
+}
+
+# Prints <file> with each [ssd] serverN at localhost:<port_base> + N
+servers_at() {
+	awk -v base="$2" '
+		/^\[/ { inside = ($0 == "[ssd]") }
+		inside && /^server[0-9]+=/ {
+			n = substr($0, 7, index($0, "=") - 7)
+			print "server" n "=localhost:" (base + n)
+			next
+		}
+		{ print }' "$1"
+}
+
+# Waits up to 5 seconds for a port on localhost to accept connections
+wait_port() {
+	for ((try = 0; try < 50; try++)); do
+		(exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+stop() {
+	local dir=$1
+	[ -f "$dir/pids" ] || return 0
+	local pids
+	pids=$(cat "$dir/pids")
+	kill $pids 2>/dev/null
+	for ((try = 0; try < 50; try++)); do
+		local alive=0 pid
+		for pid in $pids; do
+			kill -0 $pid 2>/dev/null && alive=1
+		done
+		[ $alive = 1 ] || break
+		sleep 0.1
+	done
+	rm -f "$dir/pids" "$dir/wanproxy.pid"
+}
+
+stats() {
+	local dir=$1 reports
+	reports=$(grep -c "Totals:" "$dir/wanproxy.log")
+	kill -USR1 "$(cat "$dir/wanproxy.pid")" || exit 69
+	for ((try = 0; try < 50; try++)); do
+		[ "$(grep -c "Totals:" "$dir/wanproxy.log")" -gt "$reports" ] && break
+		sleep 0.1
+	done
+	grep "Totals:" "$dir/wanproxy.log" | tail -1 |
+		sed -E 's/.*Totals: ([0-9]+) bytes up, ([0-9]+) bytes down, ([0-9]+) calls.*/\1 \2 \3/'
+}
+
+start() {
+	local config=$1 region=$2 dir=$3
+	if [ ! -f "$config" ] || [ -z "$region" ] || [ -z "$dir" ]; then
+		echo "Usage: $0 start <config_file> <client_region> <dir>" >&2
+		exit 64
+	fi
+	mkdir -p "$dir"
+	stop "$dir"
+
+	local num_servers server_port proxy_port
+	num_servers=$(ini_get "$config" ssd num_servers 0)
+	server_port=$(ini_get "$config" wan server_port 19080)
+	proxy_port=$(ini_get "$config" wan proxy_port 18080)
+
+	for ((i = 0; i < num_servers; i++)); do
+		for port in $((server_port + i)) $((proxy_port + i)); do
+			if (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null; then
+				echo "Port $port is already in use" >&2
+				exit 69
+			fi
+		done
+	done
+
+	servers_at "$config" "$server_port" > "$dir/server.ini"
+	servers_at "$config" "$proxy_port" > "$dir/client.ini"
+
+	: > "$dir/pids"
+	for ((i = 0; i < num_servers; i++)); do
+		"$bin/ssd" "$dir/server.ini" $i > "$dir/ssd$i.log" 2>&1 &
+		echo $! >> "$dir/pids"
+	done
+	"$bin/wanproxy" "$dir/server.ini" "$region" > "$dir/wanproxy.log" 2>&1 &
+	echo $! >> "$dir/pids"
+	echo $! > "$dir/wanproxy.pid"
+
+	for ((i = 0; i < num_servers; i++)); do
+		if ! wait_port $((server_port + i)) || ! wait_port $((proxy_port + i)); then
+			echo "Server $i did not come up; see $dir/ssd$i.log and $dir/wanproxy.log" >&2
+			stop "$dir"
+			exit 69
+		fi
+	done
+	echo "$num_servers servers up as seen from $region; use $dir/client.ini"
+}
+
+case "$1" in
+	start) start "$2" "$3" "$4" ;;
+	stats) stats "$2" ;;
+	stop) stop "$2" ;;
+	*)
+		echo "Usage: $0 start <config_file> <client_region> <dir>" >&2
+		echo "       $0 stats <dir>" >&2
+		echo "       $0 stop <dir>" >&2
+		exit 64
+		;;
+esac
@@ -0,0 +1,147 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <sysexits.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "inih/INIReader.h"
+
+#include "logger.hpp"
+#include "WanProxy.hpp"
+
+using namespace std;
+
+// A [wan] value for the link between regions a and b: key_a_b or key_b_a
+// if either is set, else key
+static double linkValue(INIReader& config, const string& key, const string& a, const string& b, double fallback)
+{
+	double value = config.GetReal("wan", key, fallback);
+	value = config.GetReal("wan", key + "_" + b + "_" + a, value);
+	return config.GetReal("wan", key + "_" + a + "_" + b, value);
+}
+
+// Logs what each link carried since the last report, then the totals
+static void report(vector<unique_ptr<WanProxy>>& proxies, const vector<string>& names)
+{
+	auto log = logger();
+
+	uint64_t up = 0, down = 0, calls = 0;
+	for (size_t i = 0; i < proxies.size(); ++i) {
+		WanLink::Stats stats = proxies[i]->getLink().takeStats();
+		uint64_t linkCalls = 0;
+		string methods;
+		for (auto& entry : stats.calls) {
+			linkCalls += entry.second;
+			methods += " " + entry.first + "=" + std::to_string(entry.second);
+		}
+		log->info("Link {} ({}): {} bytes up, {} bytes down, {} calls:{}", i, names[i],
+		          stats.bytes[WanLink::UP], stats.bytes[WanLink::DOWN], linkCalls, methods);
+		up += stats.bytes[WanLink::UP];
+		down += stats.bytes[WanLink::DOWN];
+		calls += linkCalls;
+	}
+	log->info("Totals: {} bytes up, {} bytes down, {} calls", up, down, calls);
+}
+
+int main(int argc, char** argv) {
+	initLogging();
+
+	auto log = logger();
+
+	// Handle the command-line argument
+	if (argc != 3) {
+		cerr << "Usage: " << argv[0] << " [config_file] [client_region]" << endl;
+		return EX_USAGE;
+	}
+
+	// Read in the configuration file
+	INIReader config(argv[1]);
+
+	if (config.ParseError() < 0) {
+		cerr << "Error parsing config file " << argv[1] << endl;
+		return EX_CONFIG;
+	}
+	string region = argv[2];
+
+	int num_servers = (int) config.GetInteger("ssd", "num_servers", -1);
+	if (num_servers <= 0) {
+		log->error("num_servers {} is invalid", num_servers);
+		return EX_CONFIG;
+	}
+	int proxy_port = (int) config.GetInteger("wan", "proxy_port", 18080);
+	uint64_t seed = (uint64_t) config.GetInteger("wan", "seed", 1);
+
+	bool known = false;
+	for (int i = 0; i < num_servers; ++i) {
+		known |= config.Get("wan", "region"+std::to_string(i), "") == region;
+	}
+	if (!known) {
+		log->error("No server is in region {}", region);
+		return EX_CONFIG;
+	}
+
+	// Server N is reached through port proxy_port + N over the link
+	// between the client's region and regionN
+	vector<unique_ptr<WanProxy>> proxies;
+	vector<string> names;
+	for (int i = 0; i < num_servers; ++i) {
+		string servconf = config.Get("ssd", "server"+std::to_string(i), "");
+		size_t idx = servconf.rfind(":");
+		if (idx == string::npos) {
+			log->error("Invalid server{} entry: {}", i, servconf);
+			return EX_CONFIG;
+		}
+		string host = servconf.substr(0, idx);
+		int port = (int) strtol(servconf.substr(idx+1).c_str(), nullptr, 10);
+
+		string server_region = config.Get("wan", "region"+std::to_string(i), "");
+		if (server_region.empty()) {
+			log->error("No region{} under [wan]", i);
+			return EX_CONFIG;
+		}
+
+		LinkShape shape;
+		shape.rttMs = linkValue(config, "rtt_ms", region, server_region, 1);
+		shape.jitterMs = linkValue(config, "jitter_ms", region, server_region, 0);
+		shape.mbps = linkValue(config, "mbps", region, server_region, 0);
+		shape.loss = linkValue(config, "loss", region, server_region, 0);
+		if (shape.rttMs < 0 || shape.jitterMs < 0 || shape.mbps < 0 || shape.loss < 0 || shape.loss >= 1) {
+			log->error("Invalid link from {} to {}", region, server_region);
+			return EX_CONFIG;
+		}
+
+		proxies.push_back(unique_ptr<WanProxy>(new WanProxy(proxy_port + i, host, port, shape, seed + i)));
+		names.push_back(region + "-" + server_region);
+	}
+
+	// Signals are taken below rather than by the proxy threads, which
+	// inherit this mask
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	// A proxy returns only if it cannot listen, and the emulation is
+	// no good without it
+	for (auto& proxy : proxies) {
+		WanProxy* p = proxy.get();
+		thread([p]() {
+			p->run();
+			exit(EX_UNAVAILABLE);
+		}).detach();
+	}
+
+	// SIGUSR1 reports and resets the counters; SIGINT and SIGTERM report
+	// them and exit
+	while (true) {
+		int sig = 0;
+		sigwait(&signals, &sig);
+		report(proxies, names);
+		if (sig != SIGUSR1) {
+			return 0;
+		}
+	}
+}